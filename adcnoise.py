@@ -0,0 +1,144 @@
+#!/usr/bin/env python
+"""Measure the accuracy of the ADC from recordings, to compare ADC clocks (adcplan.py):
+
+   python adcnoise.py [-t tone Hz] REC1.WAV [REC2.WAV ...]
+
+Make the recordings as 16-bit PCM with DC blocking and AGC off ('M' options), once for each
+ADC clock divider set with OPTION_ADC_PRESCALER, from the same source and at the same gain:
+
+  - with the inputs shorted (or the source muted), for the idle noise and offset
+  - with a clean sine on the inputs, a few dB below full scale, given with -t
+
+For each channel of each file it prints, in 12-bit LSBs (the ADC is 12-bit left-adjusted, so
+one LSB is 16 in the file):
+
+  - the offset (mean) and the RMS and peak-to-peak of what is left around it, or around the
+    fitted sine with -t
+  - with -t, the sine's amplitude, the SINAD in dB and the effective number of bits
+
+The sine is fitted (amplitude, phase and offset) to each block of BLOCK samples on its own. The
+tone's frequency is first corrected from how its phase moves from block to block, so the rate
+clock's few hundred ppm of error (see adcplan.h) and the generator's do not show up as noise.
+The first SKIP_MS of each file are left out while the input coupling settles.
+
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+
+"""
+
+import sys
+import math
+import struct
+import wave
+
+LSB = 16                  # File units per 12-bit ADC step
+BLOCK = 2048              # Samples per sine fit
+SKIP_MS = 100             # Start of the recording to leave out
+
+def channels_of(fname):
+  w = wave.open(fname, 'rb')
+  if w.getsampwidth() != 2:
+    raise SystemExit('%s: not 16-bit PCM' % fname)
+  n = w.getnchannels()
+  fs = w.getframerate()
+  data = w.readframes(w.getnframes())
+  w.close()
+  samples = struct.unpack('<%dh' % (len(data)//2), data)
+  skip = fs*SKIP_MS//1000*n
+  return fs, [[x/float(LSB) for x in samples[skip+c::n]] for c in range(n)]
+
+def solve3(m, v):
+  """Solve the 3x3 system m.x = v by Cramer's rule"""
+  def det(a):
+    return (a[0][0]*(a[1][1]*a[2][2] - a[1][2]*a[2][1])
+          - a[0][1]*(a[1][0]*a[2][2] - a[1][2]*a[2][0])
+          + a[0][2]*(a[1][0]*a[2][1] - a[1][1]*a[2][0]))
+  d = det(m)
+  x = []
+  for i in range(3):
+    a = [row[:] for row in m]
+    for r in range(3):
+      a[r][i] = v[r]
+    x.append(det(a)/d)
+  return x
+
+def sine_fit(block, w):
+  """Least squares fit of a*cos(w n) + b*sin(w n) + c: (amplitude, phase, residual list)"""
+  basis = [(math.cos(w*n), math.sin(w*n), 1.0) for n in range(len(block))]
+  m = [[sum(p[i]*p[j] for p in basis) for j in range(3)] for i in range(3)]
+  v = [sum(p[i]*y for p, y in zip(basis, block)) for i in range(3)]
+  a, b, c = solve3(m, v)
+  resid = [y - (a*p[0] + b*p[1] + c) for p, y in zip(basis, block)]
+  return math.hypot(a, b), math.atan2(-b, a), resid
+
+def fit_blocks(x, w):
+  """Sine fits of each block at angular frequency w: (amplitudes, phases, residuals)"""
+  amps, phases, resid = [], [], []
+  for i in range(0, len(x) - BLOCK + 1, BLOCK):
+    a, ph, r = sine_fit(x[i:i+BLOCK], w)
+    amps.append(a)
+    phases.append(ph - w*i)
+    resid.extend(r)
+  if not amps:
+    raise SystemExit('recording shorter than %d samples' % BLOCK)
+  return amps, phases, resid
+
+def drift(phases):
+  """Average phase change from one block to the next"""
+  if len(phases) < 2:
+    return 0.0
+  steps = [(q - p + math.pi) % (2*math.pi) - math.pi for p, q in zip(phases, phases[1:])]
+  return sum(steps)/len(steps)
+
+def measure(x, fs, tone):
+  mean = sum(x)/len(x)
+  if not tone:
+    resid = [y - mean for y in x]
+    amp = None
+  else:
+    w = 2*math.pi*tone/fs
+    for i in range(3):
+      amps, phases, resid = fit_blocks(x, w)
+      w += drift(phases)/BLOCK
+    amp = sum(amps)/len(amps)
+  rms = math.sqrt(sum(r*r for r in resid)/len(resid))
+  return mean, rms, max(resid) - min(resid), amp
+
+tone = None
+args = sys.argv[1:]
+if len(args) > 1 and args[0] == '-t':
+  tone = float(args[1])
+  args = args[2:]
+if not args:
+  raise SystemExit(__doc__.split('\n\n')[1])
+
+print("%-14s %2s %8s %8s %8s %8s %8s %6s" % ("file", "ch", "offset", "rms", "p-p", "tone", "SINAD", "ENOB"))
+for fname in args:
+  fs, chans = channels_of(fname)
+  for c, x in enumerate(chans):
+    mean, rms, pp, amp = measure(x, fs, tone)
+    if amp is None:
+      print("%-14s %2d %8.2f %8.3f %8.1f %8s %8s %6s" % (fname, c, mean, rms, pp, "-", "-", "-"))
+    else:
+      sinad = 20*math.log10(amp/math.sqrt(2)/rms) if rms else float('inf')
+      print("%-14s %2d %8.2f %8.3f %8.1f %8.1f %8.1f %6.2f" % (fname, c, mean, rms, pp, amp, sinad,
+        (sinad - 1.76)/6.02))
+
+# vim: expandtab ts=2 sw=2 ai
@@ -0,0 +1,160 @@
+#!/usr/bin/env python
+"""Work out the ADC prescaler and the range of sampling rates the rate clock and the ADC can
+run at, and write them to a C header (src/adcplan.h) for adc.c and rateclock.c:
+
+   python adcplan.py [header]
+
+With no argument the header is printed instead. The Makefile regenerates it on every build, so
+to change the plan edit the limits below, not the header.
+
+The ADC is clocked from the 32 MHz peripheral clock through a prescaler of 4 to 512. The
+fastest ADC clock gives the shortest and least jittery conversions, so the plan takes the
+smallest prescaler that keeps the ADC clock within its specs:
+
+  - at most ADC_MAX_CLOCK. Every channel uses the gain stage (even at 1X), which is only
+    characterized up to 1 MHz, half of what the bare ADC allows.
+  - at least ADC_MIN_CLOCK, below which the datasheet gives no accuracy figures.
+
+On each rate clock event the ADC sweeps 2 channels (CH0-CH1, mono and stereo alike) or 4
+(CH0-CH3, four-channel recording). The ADC is pipelined: the first result is ready
+CONVERSION_CLOCKS ADC clocks after the sweep starts and each further channel one clock later.
+A sweep may take up to SWEEP_SHARE of the sample period, leaving the rest for DMA to pick up
+the results before the next sweep. That sets the highest sampling rate for each sweep.
+
+Four channels are only recorded, and the recording is limited to the data rate of 16-bit
+stereo at 44.1 kHz (RECORD_MAX_BPS), which SD recording and the 'J' stream are sized for. That
+is REC_QUAD_MAX_FS in rec.h, below what the ADC itself could sweep.
+
+The lowest sampling rate is the one where the rate clock's period (32 MHz / Fs, see
+rateclock.c) still fits in TCC0's 16 bits.
+
+The prescaler can be overridden at run time with the 'M' command's OPTION_ADC_PRESCALER to
+compare the accuracy of ADC clocks (see adcnoise.py). The rate limits then scale with the ADC
+clock.
+
+The header also lists the common rates, with the ADC clock, how much of the sample period the
+sweep takes and how far the rate clock's actual rate is from the one asked for.
+
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+
+"""
+
+import sys
+
+CLOCK = 32000000          # Peripheral clock, Hz
+ADC_MAX_CLOCK = 1000000   # Gain stage limit, Hz
+ADC_MIN_CLOCK = 100000    # Lowest ADC clock with specified accuracy, Hz
+CONVERSION_CLOCKS = 8     # 12-bit result 7 ADC clocks after the start, plus 1 for the gain stage
+SWEEP_SHARE = 0.5         # Part of the sample period a sweep may take
+PRESCALERS = [4, 8, 16, 32, 64, 128, 256, 512]
+SWEEPS = [2, 4]           # ADC channels converted per sample
+RATES = [8000, 11025, 16000, 22050, 32000, 44100, 48000]
+MAX_FS = 65535            # Sampling rates are 16 bits throughout
+RECORD_MAX_BPS = 44100*2*2  # Bytes per second of a four-channel recording: 16-bit stereo at 44.1 kHz
+
+def adc_clock(div):
+  return CLOCK // div
+
+def prescaler():
+  """The smallest prescaler within the ADC clock limits, or None"""
+  for div in PRESCALERS:
+    if ADC_MIN_CLOCK <= adc_clock(div) <= ADC_MAX_CLOCK:
+      return div
+  return None
+
+def sweep_clocks(channels):
+  return CONVERSION_CLOCKS + channels - 1
+
+def max_fs(div, channels):
+  """Highest sampling rate at which a sweep fits in its share of the sample period"""
+  return min(MAX_FS, int(adc_clock(div) * SWEEP_SHARE / sweep_clocks(channels)))
+
+def rec_max_fs(div, channels):
+  """Highest sampling rate at which 'channels' can be recorded"""
+  if channels < 4:
+    return max_fs(div, channels)
+  return min(max_fs(div, channels), RECORD_MAX_BPS // (2*channels))
+
+def min_fs():
+  """Lowest sampling rate with a rate clock period (TCC0.PER+1) of at most 65536"""
+  fs = 1
+  while CLOCK // fs > 65536:
+    fs += 1
+  return fs
+
+def header():
+  div = prescaler()
+  if div is None:
+    raise SystemExit('adcplan.py: no prescaler gives an ADC clock within the limits')
+
+  out = []
+  out.append('// Generated by adcplan.py on every build -- do not edit. Change the limits in adcplan.py.')
+  out.append('#ifndef _ADCPLAN_H_')
+  out.append('#define _ADCPLAN_H_')
+  out.append('')
+  out.append('// ADC prescaler: the fastest ADC clock within specs, %d Hz' % adc_clock(div))
+  out.append('#define ADCPLAN_PRESCALER     ADC_PRESCALER_DIV%d_gc' % div)
+  out.append('#define ADCPLAN_PRESCALER_DIV %dU' % div)
+  out.append('')
+  out.append('// Highest sampling rate for a sweep of 2 channels (CH0-CH1) and of 4 channels (CH0-CH3)')
+  for channels in SWEEPS:
+    out.append('#define ADCPLAN_MAX_FS_%d      %dU' % (channels, max_fs(div, channels)))
+  out.append('')
+  out.append('// Highest sampling rate four channels are recorded at, also limited by the data rate')
+  out.append('#define ADCPLAN_REC_MAX_FS_4  %dU' % rec_max_fs(div, 4))
+  out.append('')
+  out.append('// Lowest sampling rate the rate clock can make')
+  out.append('#define ADCPLAN_MIN_FS        %dU' % min_fs())
+  out.append('')
+  out.append('/* Common rates:')
+  out.append('')
+  out.append('     Fs     channels  prescaler  ADC clock  sweep/period  rate clock error')
+  for fs in RATES:
+    period = CLOCK // fs
+    error = (CLOCK / float(period) - fs) * 1e6 / fs
+    for channels in SWEEPS:
+      if fs <= rec_max_fs(div, channels):
+        share = sweep_clocks(channels) * fs * 100.0 / adc_clock(div)
+        out.append('     %-6d %-9d DIV%-7d %-10d %5.1f%%        %+.0f ppm'
+                   % (fs, channels, div, adc_clock(div), share, error))
+      elif fs <= max_fs(div, channels):
+        out.append('     %-6d %-9d unsupported (data rate)' % (fs, channels))
+      else:
+        out.append('     %-6d %-9d unsupported' % (fs, channels))
+  out.append('*/')
+  out.append('')
+  out.append('#endif // _ADCPLAN_H_')
+  return '\n'.join(out) + '\n'
+
+if __name__ == '__main__':
+  text = header()
+  if len(sys.argv) > 1:
+    try:
+      old = open(sys.argv[1]).read()
+    except IOError:
+      old = None
+    # Leave the file alone if nothing changed so that make does not rebuild for nothing
+    if text != old:
+      open(sys.argv[1], 'w').write(text)
+  else:
+    sys.stdout.write(text)
+
+# vim: expandtab ts=2 sw=2 ai
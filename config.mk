@@ -87,6 +87,7 @@ OBJCOPY=${TOOLPREFIX}avr-objcopy${TOOLSUFFIX}
 
 SRCS= main.c sio.c utils.c timer.c clocks.c spi_C_slave.c rec.c adc.c \
 	buffers.c dac.c play.c state.c i2c.c wavwrite.c wavread.c fail.c dma.c \
-	rateclock.c printf.c bootloader.c pass.c ff.c
+	rateclock.c printf.c bootloader.c pass.c ff.c seq.c \
+	clmap.c adpcm.c pack12.c cue.c peak.c dcblock.c agc.c decim.c sdlat.c
 OBJS=$(SRCS:.c=.o)
 
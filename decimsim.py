@@ -0,0 +1,169 @@
+#!/usr/bin/env python
+"""Host simulation of decimated recording (decim.c). A synthetic tone plus analog noise is
+sampled by a model of the 12-bit ADC at M times the output rate, run through the same
+decimator as the firmware (integer arithmetic included) and compared with sampling at the
+output rate directly:
+
+   python decimsim.py [output rate]
+
+The firmware decimates with a third-order CIC filter down to twice the output rate and then a
+halfband FIR filter. For comparison, a CIC filter alone of order 1 to 3 is also shown. For each
+decimation factor and filter it prints:
+
+  - SNR of a 440 Hz tone (noise and distortion over the whole output band), and the equivalent
+    number of bits
+  - how much a tone that would alias onto 440 Hz is attenuated, and the same for a tone at 0.62
+    of the output rate, which aliases to 0.38 of it, near the top of the band
+  - the estimated AVR cycles per output sample, from the number of additions, subtractions
+    and multiplications the decimator does for each input and output sample
+
+It then prints, for the firmware's filter, the most input samples per second (all channels
+together) the decimator can take while using no more than CPU_SHARE of the CPU. These are the
+limits in rec.c (gRecDecimMaxInput).
+
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+
+"""
+
+import math
+import random
+import sys
+
+OUTPUTS = 4096        # Output samples per test
+SETTLE = 32           # Output samples skipped before each test
+NOISE_LSB = 0.5       # RMS analog noise at the ADC input, in 12-bit LSB's
+AMPLITUDE = 1800.0    # Tone amplitude in 12-bit LSB's (full scale is 2048)
+CLOCK = 32e6          # CPU clock, Hz
+CPU_SHARE = 0.5       # Most of the CPU the decimator may use; the rest is for SD writes and SPI
+
+# Estimated AVR cycles: per input sample (load, sign extend, loop) plus per integrator, and per
+# CIC output sample (shift) plus per comb. The halfband filter costs per input (into its ring)
+# and per output (centre tap, rounding, saturation, store) plus per coefficient pair.
+CYCLES_IN, CYCLES_IN_STAGE = 10, 8
+CYCLES_OUT, CYCLES_OUT_STAGE = 30, 20
+CYCLES_HB_IN, CYCLES_HB_OUT, CYCLES_HB_PAIR = 12, 40, 45
+
+# Halfband coefficients from decim.c: doubled, Q15, working outwards from the centre tap
+HALFBAND = [20703, -6492, 3441, -2031, 1212, -698, 374, -178, 69, -16]
+TAPS = 4*len(HALFBAND) - 1
+
+def adc(t, freq):
+  """One conversion: left-adjusted signed 12-bit result, as DMA stores it"""
+  x = AMPLITUDE*math.sin(2*math.pi*freq*t) + random.gauss(0, NOISE_LSB)
+  q = max(-2048, min(2047, int(round(x))))
+  return q << 4
+
+def cic(samples, shift, order):
+  """Decimate by 2**shift with an order 'order' CIC, in 32-bit wrapping arithmetic like decim.c"""
+  M = 1 << shift
+  integ = [0]*order
+  comb = [0]*order
+  out = []
+  for n, x in enumerate(samples):
+    acc = x
+    for i in range(order):
+      integ[i] = (integ[i] + acc) & 0xFFFFFFFF
+      acc = integ[i]
+    if (n % M) == M-1:
+      for i in range(order):
+        acc, comb[i] = (acc - comb[i]) & 0xFFFFFFFF, acc
+      if acc & 0x80000000: acc -= 1 << 32
+      out.append(acc >> (shift*order))
+  return out
+
+def halfband(samples):
+  """Decimate by 2 like decim.c: outputs for every other input, from a ring of TAPS inputs"""
+  hist = [0]*TAPS
+  out = []
+  for n, x in enumerate(samples):
+    hist = [x] + hist[:-1]     # hist[k] is k samples old
+    if n % 2 == 1:
+      acc = (hist[TAPS//2] << 14) + (1 << 14)
+      for k, c in enumerate(HALFBAND):
+        acc += c*((hist[TAPS//2-1-2*k] >> 1) + (hist[TAPS//2+1+2*k] >> 1))
+      out.append(max(-32768, min(32767, acc >> 15)))
+  return out
+
+def fit(samples, freq, Fs):
+  """Least squares fit of a tone at freq. Returns (tone amplitude, RMS of what is left)."""
+  n = len(samples)
+  w = 2*math.pi*freq/Fs
+  mean = sum(samples)/float(n)
+  a = 2.0/n*sum((s-mean)*math.cos(w*k) for k, s in enumerate(samples))
+  b = 2.0/n*sum((s-mean)*math.sin(w*k) for k, s in enumerate(samples))
+  resid = [s - mean - a*math.cos(w*k) - b*math.sin(w*k) for k, s in enumerate(samples)]
+  return math.hypot(a, b), math.sqrt(sum(r*r for r in resid)/n)
+
+def run(Fs, shift, order, freq):
+  """Output samples, less the first few while the decimator fills up. Order 0 is the
+  firmware's CIC plus halfband filter."""
+  M = 1 << shift
+  inputs = [adc(k/float(Fs*M), freq) for k in range((OUTPUTS+SETTLE)*M)]
+  if shift == 0:
+    out = inputs
+  elif order == 0:
+    out = halfband(cic(inputs, shift-1, 3) if shift > 1 else inputs)
+  else:
+    out = cic(inputs, shift, order)
+  return out[SETTLE:]
+
+def cycles(shift, order):
+  M = 1 << shift
+  if shift == 0:
+    return 0
+  if order:
+    return M*(CYCLES_IN + CYCLES_IN_STAGE*order) + CYCLES_OUT + CYCLES_OUT_STAGE*order
+  n = 2*CYCLES_HB_IN + CYCLES_HB_OUT + CYCLES_HB_PAIR*len(HALFBAND)
+  if shift > 1:
+    n += M*(CYCLES_IN + CYCLES_IN_STAGE*3) + 2*(CYCLES_OUT + CYCLES_OUT_STAGE*3)
+  return n
+
+Fs = int(sys.argv[1]) if len(sys.argv) > 1 else 8000
+tone = round(440.0*OUTPUTS/Fs)*Fs/float(OUTPUTS)   # Whole number of cycles per test
+alias = Fs - tone
+edge = round(0.38*OUTPUTS)*Fs/float(OUTPUTS)
+random.seed(1)
+
+def rejection(Fs, shift, order, freq, seen):
+  amp, _ = fit(run(Fs, shift, order, freq), seen, Fs)
+  return 20*math.log10(max(amp, 1e-3)/(AMPLITUDE*16))
+
+print("Output rate %d Hz, tone %.1f Hz, alias test tones %.1f Hz and %.1f Hz" % (Fs, tone, alias, Fs-edge))
+print("%-3s %-10s %8s %8s %10s %10s %12s" % ("M", "filter", "SNR dB", "ENOB", "alias dB", "edge dB", "cycles/out"))
+for shift in range(4):
+  for order in ((0,) if shift == 0 else (1, 2, 3, 0)):
+    M = 1 << shift
+    amp, noise = fit(run(Fs, shift, order, tone), tone, Fs)
+    snr = 20*math.log10(amp/math.sqrt(2)/noise)
+    enob = (snr - 1.76)/6.02
+    name = "none" if shift == 0 else ("CIC%d" % order if order else "CIC3+HB")
+    print("%-3d %-10s %8.1f %8.2f %10.1f %10.1f %12d" % (M, name, snr, enob,
+      rejection(Fs, shift, order, alias, tone), rejection(Fs, shift, order, Fs-edge, edge),
+      cycles(shift, order)))
+
+print("")
+print("Decimator input ceiling at %d%% of the CPU" % (CPU_SHARE*100))
+print("%-3s %12s %10s" % ("M", "cycles/out", "max in/s"))
+for shift in range(1, 4):
+  M = 1 << shift
+  print("%-3d %12d %10d" % (M, cycles(shift, 0), int(CPU_SHARE*CLOCK*M/cycles(shift, 0))))
+
+# vim: expandtab ts=2 sw=2 ai
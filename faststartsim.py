@@ -0,0 +1,147 @@
+#!/usr/bin/env python
+"""Host simulation of the start of SD playback ('P'), with and without fast start (play.c,
+wavread.c), from a model of how long the SD card and the AVR take to get the first buffer
+ready:
+
+   python faststartsim.py [read latency in ms]
+
+A normal start reads a whole buffer (BUFFER_SIZE bytes) and then starts DMA. A fast start reads
+only 'first' bytes, starts DMA, and reads the rest of the buffer while those play. That is safe
+only if the rest is read and prepared (gain, DAC format) before DMA gets to it, so 'first' has
+to cover that much playing time. wav_first_sector_bytes() makes it the part of the sector the
+audio starts in, plus the next sector if that is too short, where "too short" is less than
+LEAD_MS of audio. Rates where even that is too short get a normal start.
+
+The audio can start anywhere in a sector (after a 44-byte header it starts 44 bytes in), so
+every even offset is tried. For each format and SPI clock it prints:
+
+  - worst command-to-DMA time of a normal start and of a fast start, and the fast start time
+    for audio after a plain 44-byte header, in ms
+  - the smallest margin, in ms, between the rest of the buffer being ready and DMA getting to it
+    (negative means stale samples are played)
+  - how many of the 256 offsets underrun when 'first' is just the rest of the sector, the way
+    fast start used to work, and how many get a normal start under the LEAD_MS rule
+
+The card model: FatFs (_FS_TINY) reads a partial sector through its window, so every sector
+touched costs a whole 512-byte transfer, and whole sectors are read straight into the buffer
+with one multiple block read. Each read command waits READ_LATENCY ms for the first block and
+BLOCK_GAP ms for each following block.
+
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+
+"""
+
+import sys
+
+CLOCK = 32e6              # CPU clock, Hz
+SECTOR = 512
+BUFFER_SIZE = 1024        # buffers.h
+LEAD_MS = 8               # WAV_FAST_START_LEAD_MS in wavread.c
+READ_LATENCY = 2.0        # ms from read command to first data block, a slow card
+BLOCK_GAP = 0.1           # ms between blocks of a multiple block read
+CMD_BYTES = 8             # Command, response and CRC bytes around each read
+BYTE_CYCLES = 40          # CPU cycles per byte in the driver's receive loop, at least
+PREP_CYCLES = 70          # CPU cycles per 16-bit sample for gain and DAC format conversion
+
+SPI_CLOCKS = [4e6, 8e6, 16e6]
+FORMATS = [               # (name, bytes per second)
+  ("8k mono", 8000*2),
+  ("22.05k stereo", 22050*4),
+  ("44.1k mono", 44100*2),
+  ("44.1k stereo", 44100*4),
+  ("48k stereo", 48000*4),
+]
+
+def byte_ms(spi):
+  return max(8/spi, BYTE_CYCLES/CLOCK)*1e3
+
+def read_ms(start, length, spi):
+  """Time for f_read() of 'length' bytes from file offset 'start'"""
+  t = 0.0
+  end = start + length
+  pos = start
+  while pos < end:
+    if pos % SECTOR or end - pos < SECTOR:
+      # Partial sector, through the window
+      t += READ_LATENCY + (CMD_BYTES + SECTOR)*byte_ms(spi)
+      pos = (pos // SECTOR + 1)*SECTOR
+    else:
+      # Whole sectors, one multiple block read
+      n = (end - pos) // SECTOR
+      t += READ_LATENCY + (n-1)*BLOCK_GAP + (CMD_BYTES + n*SECTOR)*byte_ms(spi)
+      pos += n*SECTOR
+  return t
+
+def prep_ms(length):
+  return length/2*PREP_CYCLES/CLOCK*1e3
+
+def first_bytes(partial, Bps):
+  """wav_first_sector_bytes(): 0 for a normal start"""
+  need = Bps*LEAD_MS/1000
+  if partial >= need:
+    first = partial
+  elif partial + SECTOR >= need:
+    first = partial + SECTOR
+  else:
+    return 0
+  return first if first < BUFFER_SIZE else 0
+
+def start(ofs, first, Bps, spi):
+  """(command to DMA in ms, margin in ms) of a start reading 'first' bytes, 0 for a whole buffer"""
+  if first == 0:
+    return read_ms(ofs, BUFFER_SIZE, spi) + prep_ms(BUFFER_SIZE), None
+  t = read_ms(ofs, first, spi) + prep_ms(first)
+  rest = read_ms(ofs + first, BUFFER_SIZE - first, spi) + prep_ms(BUFFER_SIZE - first)
+  return t, first/float(Bps)*1e3 - rest
+
+if len(sys.argv) > 1:
+  READ_LATENCY = float(sys.argv[1])
+
+print("Read latency %.1f ms, block gap %.1f ms, lead %d ms" % (READ_LATENCY, BLOCK_GAP, LEAD_MS))
+print("%-14s %-5s %8s %8s %8s %8s %10s %8s" % ("format", "SPI", "normal", "fast", "fast@44", "margin",
+  "old under", "normal"))
+for name, Bps in FORMATS:
+  for spi in SPI_CLOCKS:
+    normal = fast = 0.0
+    margin = None
+    old_under = fallback = 0
+    for ofs in range(0, SECTOR, 2):
+      partial = SECTOR - ofs
+      t, _ = start(ofs, 0, Bps, spi)
+      normal = max(normal, t)
+
+      first = first_bytes(partial, Bps)
+      t, m = start(ofs, first, Bps, spi)
+      fast = max(fast, t)
+      if ofs == 44:
+        fast44 = t
+      if m is None:
+        fallback += 1
+      elif margin is None or m < margin:
+        margin = m
+
+      _, m = start(ofs, partial, Bps, spi)
+      if m < 0:
+        old_under += 1
+    print("%-14s %-5s %8.2f %8.2f %8.2f %8s %10d %8d" % (name, "%dM" % (spi/1e6), normal, fast, fast44,
+      "-" if margin is None else "%.2f" % margin, old_under, fallback))
+
+# vim: expandtab ts=2 sw=2 ai
@@ -0,0 +1,135 @@
+#!/usr/bin/env python
+"""Host simulation of main-loop stalls while recording PCM to SD (rec.c, wavwrite.c), writing
+each sector as DMA fills it (OPTION_REC_SECTOR_FLUSH, the default) or whole buffers:
+
+   python flushsim.py [SPI clock in MHz] [housekeeping stall in ms]
+
+The main loop does nothing else while a write is in progress, so the longest write is the
+longest an SPI command waits to be handled. For each format and flush mode it prints:
+
+  - writes per second
+  - the time of a write within a cluster, in ms, which most writes take
+  - the longest write in ms, first without and then with the card's housekeeping stalls
+  - the share of the time spent writing
+  - the smallest margin, in ms, between a write finishing and DMA coming back round to the
+    sector or buffer it was writing (negative means lost audio), and how many writes that was
+    negative for
+
+A sector is written as soon as it is full, and DMA can fill the other REC_SECTORS-1 sectors
+before it needs it back. A whole buffer is written once it is full, and DMA can fill the other
+buffer before it needs it back. Idle-time work (checkpoints, sidecar spills) is left out: it is
+the same for both modes.
+
+The card model: FatFs (_FS_TINY) writes whole sectors straight from the buffer, one sector with
+a single block write and more with one multiple block write. A single block write keeps the card
+busy for WRITE_BUSY ms, a multiple block write for BLOCK_BUSY ms a block and STOP_BUSY ms at the
+end. Going into a new cluster reads the FAT sector, and every FAT_ENTRIES clusters the FAT sector
+is written back. Every HOUSEKEEPING_EVERY bytes the card stalls a write for HOUSEKEEPING_MS ms
+(erase block changes, wear levelling). These figures are a typical card's, not a measurement:
+run the firmware's '%' write-timing stats on the card in question for its own.
+
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+
+"""
+
+import sys
+
+CLOCK = 32e6              # CPU clock, Hz
+SECTOR = 512              # REC_SECTOR_SIZE in rec.h
+REC_SECTORS = 4
+BUFFER_SIZE = 1024        # buffers.h
+SPI = 8e6                 # SD card SPI clock, Hz
+CMD_BYTES = 8             # Command, response, CRC and data token bytes around each write
+BYTE_CYCLES = 40          # CPU cycles per byte in the driver's send loop, at least
+READ_LATENCY = 1.0        # ms from read command to data, for FAT sectors
+WRITE_BUSY = 1.0          # ms busy after a single block write
+BLOCK_BUSY = 0.25         # ms busy after each block of a multiple block write
+STOP_BUSY = 1.0           # ms busy after the stop token of a multiple block write
+CLUSTER = 32768           # Bytes per cluster
+FAT_ENTRIES = 128         # FAT32 entries per FAT sector
+HOUSEKEEPING_EVERY = 131072
+HOUSEKEEPING_MS = 6.0
+SECONDS = 60              # Length of recording simulated
+
+FORMATS = [               # (name, bytes per second)
+  ("8k mono", 8000*2),
+  ("22.05k stereo", 22050*4),
+  ("44.1k stereo", 44100*4),
+  ("48k stereo", 48000*4),
+]
+
+def byte_ms(n):
+  return n*max(8/SPI, BYTE_CYCLES/CLOCK)*1e3
+
+def write_ms(ofs, n, housekeeping):
+  """Time for f_write() of 'n' bytes, a whole number of sectors, at file offset 'ofs'"""
+  blocks = n // SECTOR
+  t = byte_ms(CMD_BYTES + n)
+  if blocks == 1:
+    t += WRITE_BUSY
+  else:
+    t += blocks*BLOCK_BUSY + STOP_BUSY
+  if ofs and ofs % CLUSTER == 0:
+    t += READ_LATENCY + byte_ms(CMD_BYTES + SECTOR)
+    if (ofs // CLUSTER) % FAT_ENTRIES == 0:
+      t += byte_ms(CMD_BYTES + SECTOR) + WRITE_BUSY
+  if housekeeping and ofs and ofs % HOUSEKEEPING_EVERY == 0:
+    t += HOUSEKEEPING_MS
+  return t
+
+def run(Bps, unit, ring, housekeeping):
+  """Write 'unit' bytes as each fills, DMA going round 'ring' bytes: (writes, longest, busy
+  share, smallest margin, writes with a negative margin)"""
+  per_ms = Bps/1000.0
+  total = int(SECONDS*Bps) // unit
+  t = busy = longest = 0.0
+  margin = None
+  lost = 0
+  for k in range(total):
+    t = max(t, (k+1)*unit/per_ms)                 # Wait for DMA to fill it
+    d = write_ms(k*unit, unit, housekeeping)
+    t += d
+    busy += d
+    longest = max(longest, d)
+    m = (k*unit + ring)/per_ms - t                # DMA back at its start
+    if margin is None or m < margin:
+      margin = m
+    if m < 0:
+      lost += 1
+  return total/float(SECONDS), longest, busy/(SECONDS*1e3)*100, margin, lost
+
+if len(sys.argv) > 1:
+  SPI = float(sys.argv[1])*1e6
+if len(sys.argv) > 2:
+  HOUSEKEEPING_MS = float(sys.argv[2])
+
+print("SPI %d MHz, housekeeping %.1f ms every %d KB" % (SPI/1e6, HOUSEKEEPING_MS, HOUSEKEEPING_EVERY//1024))
+print("%-14s %-7s %8s %8s %8s %8s %6s %8s %6s" % ("format", "flush", "writes/s", "typical", "longest", "+hk",
+  "busy", "margin", "lost"))
+for name, Bps in FORMATS:
+  for mode, unit in (("sector", SECTOR), ("buffer", BUFFER_SIZE)):
+    ring = REC_SECTORS*SECTOR
+    rate, quiet, _, _, _ = run(Bps, unit, ring, False)
+    _, longest, busy, margin, lost = run(Bps, unit, ring, True)
+    print("%-14s %-7s %8.0f %8.2f %8.2f %8.2f %5.1f%% %8.2f %6d" % (name, mode, rate, write_ms(unit, unit, False),
+      quiet, longest, busy, margin, lost))
+
+# vim: expandtab ts=2 sw=2 ai
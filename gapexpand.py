@@ -0,0 +1,94 @@
+#!/usr/bin/env python
+"""Put a VOX recording made with gap logging back on its real timeline. Each gap listed in
+the .GAP file that goes with the recording is filled with silence:
+
+   python gapexpand.py REC.WAV REC.GAP out.wav
+
+The .GAP file holds a pair of 32-bit little-endian values per gap: the number of sample
+frames in the WAV file before the gap and the number of frames dropped. Only 16-bit PCM
+recordings can be expanded; convert packed 12-bit recordings with unpack12.py first.
+
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+
+"""
+
+import struct
+import sys
+
+if len(sys.argv) != 4:
+  print("Usage: %s rec.wav rec.gap out.wav" % sys.argv[0])
+  sys.exit(1)
+
+try:
+  infid = open(sys.argv[1], "rb")
+  riff = infid.read()
+  infid.close()
+  infid = open(sys.argv[2], "rb")
+  gaps = infid.read()
+  infid.close()
+except:
+  print("Cannot open input file")
+  sys.exit(2)
+
+if riff[0:4] != b"RIFF" or riff[8:12] != b"WAVE":
+  print("Not a WAV file")
+  sys.exit(3)
+
+chunks = []
+blockAlign = None
+pos = 12
+while pos + 8 <= len(riff):
+  ckid = riff[pos:pos+4]
+  cksize = struct.unpack("<I", riff[pos+4:pos+8])[0]
+  body = riff[pos+8:pos+8+cksize]
+  pos += 8 + cksize + (cksize & 1)
+
+  if ckid == b"fmt ":
+    tag, channels, fs, byteRate, blockAlign, bits = struct.unpack("<HHIIHH", body[:16])
+    if tag != 1 or bits != 16:
+      print("Not a 16-bit PCM file")
+      sys.exit(4)
+  elif ckid == b"data":
+    if blockAlign is None:
+      print("No fmt chunk before data chunk")
+      sys.exit(5)
+    out = []
+    last = 0
+    for i in range(0, len(gaps) - len(gaps) % 8, 8):
+      at, dropped = struct.unpack("<II", gaps[i:i+8])
+      at = min(at * blockAlign, len(body))
+      out.append(body[last:at])
+      out.append(b"\0" * (dropped * blockAlign))
+      last = at
+    out.append(body[last:])
+    body = b"".join(out)
+  chunks.append(ckid + struct.pack("<I", len(body)) + body + (b"\0" * (len(body) & 1)))
+
+out = b"".join(chunks)
+try:
+  outfid = open(sys.argv[3], "wb")
+  outfid.write(b"RIFF" + struct.pack("<I", len(out) + 4) + b"WAVE" + out)
+  outfid.close()
+except:
+  print("Cannot write output file")
+  sys.exit(6)
+
+sys.exit(0)
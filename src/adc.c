@@ -35,6 +35,9 @@
 #include "sio.h"
 #include "utils.h"
 #include "state.h"
+#include "fail.h"
+#include "rateclock.h"
+#include "adcplan.h"
 #include "adc.h"
 
 // Control the amount of differential gain
@@ -45,12 +48,54 @@ static uint8_t gGainVal[] = {
   ADC_CH_GAIN_8X_gc | ADC_CH_INPUTMODE_DIFFWGAIN_gc
 };
 
+// Positive input of Channel 3 in four-channel recording: PA3, the auxiliary input
+#define ADC_AUX_MUXPOS ADC_CH_MUXPOS_PIN3_gc
+
 static uint8_t gGainLINE, gGainMIC;
 
+// ADC clock divider, the plan's unless overridden to measure another one (OPTION_ADC_PRESCALER)
+static uint16_t gPrescalerDiv = ADCPLAN_PRESCALER_DIV;
+static uint8_t gPrescaler = ADCPLAN_PRESCALER;
+static ADCGain_t gGainStepLINE, gGainStepMIC;
+
 void adc_set_gains(ADCGain_t line, ADCGain_t mic)
 {
   gGainLINE = gGainVal[line];
   gGainMIC = gGainVal[mic];
+  gGainStepLINE = line;
+  gGainStepMIC = mic;
+}
+
+// Use the ADC clock divider 'div' (4 to 512, a power of 2) instead of the plan's, for accuracy
+// measurements. 0, or any other value, goes back to the plan's. The rate limits scale with it.
+void adc_set_prescaler(uint16_t div)
+{
+  uint8_t gc;
+
+  for (gc = 0; gc < 8; gc++) {
+    if (div == (4U << gc)) {
+      gPrescalerDiv = div;
+      gPrescaler = gc; // ADC_PRESCALER_DIV4_gc is 0, and each step doubles the divider
+      return;
+    }
+  }
+  gPrescalerDiv = ADCPLAN_PRESCALER_DIV;
+  gPrescaler = ADCPLAN_PRESCALER;
+}
+
+// Gain channel 0 is started with for the given source
+ADCGain_t adc_get_gain(RecType_t type)
+{
+  return (type==REC_LINE) ? gGainStepLINE : gGainStepMIC;
+}
+
+// Change the gain of running conversions (for AGC). Only the channels started at the gain of
+// channel 0's input are stepped: channel 1 is LINE_R for line recording, but LINE_L, which keeps
+// the line gain, for mic recording.
+void adc_step_gain(ADCGain_t gain, RecType_t type, uint8_t stereo)
+{
+  ADCA.CH0.CTRL = gGainVal[gain];
+  if (stereo && (type == REC_LINE)) ADCA.CH1.CTRL = gGainVal[gain];
 }
 
 // Read calibration byte
@@ -72,6 +117,7 @@ void adc_init(void)
 {
   // Set default gains. Can always be changed by user.
   gGainLINE = gGainMIC = gGainVal[0]; // 1X gain
+  gGainStepLINE = gGainStepMIC = ADC_DIFF_GAIN_1X;
 
   // We have a 1.25V reference on ADC0 and a 1.25V reference on ADC1, as well as a 1.25V reference
   // on ADC4. AREFA is ADC0, hence 1.25V. Since the line-in analog inputs are biased to 1.25V, we
@@ -91,14 +137,12 @@ void adc_init(void)
   // Use ADC0 (1.25V) as the reference
   ADCA.REFCTRL = ADC_REFSEL_AREFA_gc;
 
-  /* Prescaler frequency divides 32 MHz clock to get ADC clock. Due to pipelining, we simply
-     have the the ADC clock frequency must be simply higher than the sampling rate (not sampling
-     rate multiplied by the number of bits!). However, we need to (in stereo mode) sample two
-     sets of samples per clock so the ADC clock must be higher than twice the sampling rate.
-     Assuming we occasionally want to sample at 44.1 kHz we have Fadc >= 88.2kHz and the only
-     way to get that is with a prescale of 256 so that 32 MHz/256 --> 125 kHz.
+  /* Prescaler frequency divides 32 MHz clock to get ADC clock. Due to pipelining, the ADC
+     clock need not be higher than the sampling rate multiplied by the number of bits, but a
+     whole sweep of channels must be done well within a sample period. adcplan.py works out the
+     fastest ADC clock within specs and the sampling rates it allows (see adcplan.h).
      */
-  ADCA.PRESCALER = ADC_PRESCALER_DIV256_gc;
+  ADCA.PRESCALER = gPrescaler;
 
   // Set the event control register to include channels 0 and 1 in a channel sweep when triggered.
   // The sweep will be synchronized with the event, and will be on event channel 0, which we configure
@@ -118,11 +162,35 @@ void adc_init(void)
   ADCA.CALH = read_cal_byte( offsetof(NVM_PROD_SIGNATURES_t, ADCACAL1) );
 }
 
-void adc_start(RecType_t type)
+// Highest sampling rate the ADC can keep up with: each rate clock event sweeps 4 channels for
+// REC_QUAD, otherwise 2 (even for mono)
+uint16_t adc_max_rate(RecType_t type)
+{
+  uint32_t fs = (type == REC_QUAD) ? ADCPLAN_MAX_FS_4 : ADCPLAN_MAX_FS_2;
+
+  if (gPrescalerDiv == ADCPLAN_PRESCALER_DIV) return fs;
+  fs = fs * ADCPLAN_PRESCALER_DIV / gPrescalerDiv;
+  return (fs > 65535UL) ? 65535U : fs;
+}
+
+// Whether the ADC, and the rate clock triggering it, can run at Fs. Returns 0 (and sets a fail
+// code) if not.
+uint8_t adc_rate_ok(uint16_t Fs, RecType_t type)
+{
+  if (Fs < RATECLOCK_MIN_FS) return fail(FAIL_RATE, FAIL_RATE_CLOCK);
+  if (Fs > adc_max_rate(type)) return fail(FAIL_RATE, FAIL_RATE_ADC);
+  return 1;
+}
+
+// Returns 0 (and sets a fail code, leaving the ADC off) if it cannot run at Fs
+uint8_t adc_start(RecType_t type, uint16_t Fs)
 {
   uint8_t muxctrl;
   uint8_t gain;
 
+  if (! adc_rate_ok(Fs, type)) return 0;
+  ADCA.PRESCALER = gPrescaler;
+
   // Channel 0 : PA6 (LINE_L) or PA5 (MIC) depending on MIC/LINE
   ADCA.CH0.CTRL = gain = (type==REC_LINE) ? gGainLINE : gGainMIC;
   //if (gain == ADC_DIFF_GAIN_1X) {
@@ -142,6 +210,7 @@ void adc_start(RecType_t type)
       break;
 
     case REC_MIC:
+    case REC_QUAD:
       ADCA.CH0.MUXCTRL = ADC_CH_MUXPOS_PIN5_gc | muxctrl;
       break;
   }
@@ -158,10 +227,31 @@ void adc_start(RecType_t type)
       break;
 
     case REC_MIC:
+    case REC_QUAD:
       ADCA.CH1.MUXCTRL = ADC_CH_MUXPOS_PIN6_gc | muxctrl;
       break;
   }
 
+  if (type == REC_QUAD) {
+    // Four channels: MIC, LINE_L, then Channel 2 : PA7 (LINE_R) and Channel 3 : the auxiliary input,
+    // both at line gain. The sweep covers all four channels, and the last one to finish (CH3)
+    // triggers DMA and is the only one to interrupt, just like CH1 below.
+    ADCA.CH2.CTRL = gGainLINE;
+    ADCA.CH2.MUXCTRL = ADC_CH_MUXPOS_PIN7_gc | muxctrl;
+    ADCA.CH3.CTRL = gGainLINE;
+    ADCA.CH3.MUXCTRL = ADC_AUX_MUXPOS | muxctrl;
+    ADCA.EVCTRL = ADC_SWEEP_0123_gc | ADC_EVSEL_0123_gc | ADC_EVACT_SWEEP_gc;
+
+    ADCA.CH1.INTCTRL = 0;
+    ADCA.CH3.INTFLAGS = 1;
+    ADCA.CH3.INTCTRL = ADC_CH_INTMODE_COMPLETE_gc | ADC_CH_INTLVL_HI_gc;
+
+    ADCA.CTRLA = ADC_ENABLE_bm;
+    ADCA.CTRLA = ADC_CH0START_bm | ADC_CH1START_bm | ADC_CH2START_bm | ADC_CH3START_bm | ADC_ENABLE_bm;
+    return 1;
+  }
+  ADCA.EVCTRL = ADC_SWEEP_01_gc | ADC_EVSEL_0123_gc | ADC_EVACT_SWEEP_gc;
+
   // Only CH1 will trigger interrupts. An interrupt on CH1 indicates both CH0 and CH1 have samples.
   // MUST ENABLE interrupt for DMA source (Channel 1) since it appears that it is the INTFLAG which
   // triggers the DMA, and if the flag is not cleared (by virtue of servicing the interrupt) then
@@ -173,11 +263,19 @@ void adc_start(RecType_t type)
   // Now start the conversions
   ADCA.CTRLA = ADC_ENABLE_bm; // Enable the converter
   ADCA.CTRLA = ADC_CH0START_bm | ADC_CH1START_bm | ADC_ENABLE_bm; // ...and start Channel 0 conversions and Channel 1 conversions
+  return 1;
+}
+
+// Channel 3 is the DMA trigger in four-channel recording, so like Channel 1 (see pass.c) it must
+// have an ISR to clear its interrupt flag
+ISR(ADCA_CH3_vect)
+{
 }
 
 void adc_stop(void)
 {
   ADCA.CH1.INTCTRL = 0; // Stop generating interrupts
+  ADCA.CH3.INTCTRL = 0;
   ADCA.CTRLA = 0; // Disable A/D's
 }
 
@@ -33,9 +33,14 @@ typedef enum {
 } ADCGain_t;
 
 extern void adc_init(void);
-extern void adc_start(RecType_t type);
+extern uint8_t adc_start(RecType_t type, uint16_t Fs);
+extern uint8_t adc_rate_ok(uint16_t Fs, RecType_t type);
+extern uint16_t adc_max_rate(RecType_t type);
 extern void adc_stop(void);
 extern void adc_set_gains(ADCGain_t line, ADCGain_t mic);
+extern void adc_set_prescaler(uint16_t div);
+extern ADCGain_t adc_get_gain(RecType_t type);
+extern void adc_step_gain(ADCGain_t gain, RecType_t type, uint8_t stereo);
 
 #endif // _ADC_H_
 // vim: expandtab ts=2 ai sw=2 cindent
@@ -0,0 +1,38 @@
+// Generated by adcplan.py on every build -- do not edit. Change the limits in adcplan.py.
+#ifndef _ADCPLAN_H_
+#define _ADCPLAN_H_
+
+// ADC prescaler: the fastest ADC clock within specs, 1000000 Hz
+#define ADCPLAN_PRESCALER     ADC_PRESCALER_DIV32_gc
+#define ADCPLAN_PRESCALER_DIV 32U
+
+// Highest sampling rate for a sweep of 2 channels (CH0-CH1) and of 4 channels (CH0-CH3)
+#define ADCPLAN_MAX_FS_2      55555U
+#define ADCPLAN_MAX_FS_4      45454U
+
+// Highest sampling rate four channels are recorded at, also limited by the data rate
+#define ADCPLAN_REC_MAX_FS_4  22050U
+
+// Lowest sampling rate the rate clock can make
+#define ADCPLAN_MIN_FS        489U
+
+/* Common rates:
+
+     Fs     channels  prescaler  ADC clock  sweep/period  rate clock error
+     8000   2         DIV32      1000000      7.2%        +0 ppm
+     8000   4         DIV32      1000000      8.8%        +0 ppm
+     11025  2         DIV32      1000000      9.9%        +170 ppm
+     11025  4         DIV32      1000000     12.1%        +170 ppm
+     16000  2         DIV32      1000000     14.4%        +0 ppm
+     16000  4         DIV32      1000000     17.6%        +0 ppm
+     22050  2         DIV32      1000000     19.8%        +170 ppm
+     22050  4         DIV32      1000000     24.3%        +170 ppm
+     32000  2         DIV32      1000000     28.8%        +0 ppm
+     32000  4         unsupported (data rate)
+     44100  2         DIV32      1000000     39.7%        +860 ppm
+     44100  4         unsupported (data rate)
+     48000  2         DIV32      1000000     43.2%        +1001 ppm
+     48000  4         unsupported
+*/
+
+#endif // _ADCPLAN_H_
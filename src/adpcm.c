@@ -0,0 +1,180 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+
+/*
+ * This module encodes recorded 16-bit samples to IMA ADPCM, 4:1, for writing to SD card.
+ *
+ * Encoding is done in place: a finished ping-pong buffer is replaced by its ADPCM encoding,
+ * which is then written out from the start of the same buffer. The output never catches up
+ * with the input still to be read, except right at the start of a buffer where a block header
+ * (4 bytes per channel for one sample frame) can come out before enough input has been used.
+ * The first few samples are copied aside to cover that.
+ *
+ * Blocks are not aligned with the ping-pong buffers, so a partly-collected group of samples
+ * is carried over from one buffer to the next.
+ */
+#include <string.h>
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+
+#include "config.h"
+#include "adpcm.h"
+
+#if WITH_ADPCM==1
+
+// Number of samples at the start of each buffer that are copied aside before encoding
+#define ADPCM_HEAD_SAMPLES 16
+
+typedef struct {
+  int16_t mPredicted;   // Decoder's reconstruction of the last sample
+  uint8_t mIndex;       // Index into gStepTable[]
+} AdpcmChannel_t;
+
+static const uint16_t gStepTable[89] PROGMEM = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+  11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+  32767
+};
+
+static const int8_t gIndexTable[8] PROGMEM = { -1, -1, -1, -1, 2, 4, 6, 8 }; // Index change by magnitude
+
+static AdpcmChannel_t gChannel[2];
+static int16_t gGroup[2][ADPCM_GROUP_FRAMES]; // Samples collected for the next group
+static uint8_t gChannels;
+static uint8_t gGroupFill;    // Frames in gGroup[][]
+static uint8_t gGroupsLeft;   // Groups to go in the current block, 0 if a block header is next
+static uint32_t gFrames;      // Sample frames encoded so far
+
+void adpcm_begin(uint8_t channels)
+{
+  memset(gChannel, 0, sizeof(gChannel));
+  gChannels = channels;
+  gGroupFill = 0;
+  gGroupsLeft = 0;
+  gFrames = 0;
+}
+
+// Sample frames in the encoded output, for the 'fact' chunk. A partly-collected group
+// at the end of recording is dropped.
+uint32_t adpcm_frames(void)
+{
+  return gFrames;
+}
+
+// Encode one sample to a 4-bit code and update the channel's predictor, exactly as the
+// decoder will. The quantizer is the usual shift-and-subtract, so no multiplies or divides.
+static uint8_t _encode_sample(AdpcmChannel_t *ch, int16_t sample)
+{
+  uint16_t step = pgm_read_word(&gStepTable[ch->mIndex]);
+  uint16_t diff, delta;
+  int32_t predicted;
+  uint8_t code = 0;
+  int8_t index;
+
+  if (sample < ch->mPredicted) {
+    code = 8;
+    diff = (uint16_t)ch->mPredicted - (uint16_t)sample;
+  } else {
+    diff = (uint16_t)sample - (uint16_t)ch->mPredicted;
+  }
+
+  delta = step >> 3;
+  if (diff >= step) { code |= 4; diff -= step; delta += step; }
+  step >>= 1;
+  if (diff >= step) { code |= 2; diff -= step; delta += step; }
+  step >>= 1;
+  if (diff >= step) { code |= 1; delta += step; }
+
+  predicted = ch->mPredicted;
+  if (code & 8) predicted -= delta;
+  else predicted += delta;
+  if (predicted > 32767) predicted = 32767;
+  else if (predicted < -32768) predicted = -32768;
+  ch->mPredicted = (int16_t)predicted;
+
+  index = ch->mIndex + (int8_t)pgm_read_byte(&gIndexTable[code & 7]);
+  if (index < 0) index = 0;
+  else if (index > 88) index = 88;
+  ch->mIndex = index;
+
+  return code;
+}
+
+// Encode in place 'bytes' bytes of 16-bit mono/stereo samples. Returns the number of bytes of
+// ADPCM output now at the start of buf.
+uint16_t adpcm_encode(uint8_t *buf, uint16_t bytes)
+{
+  int16_t head[ADPCM_HEAD_SAMPLES];
+  const int16_t *in = (const int16_t *)buf;
+  uint8_t *out = buf;
+  uint16_t samples = bytes/2;
+  uint16_t i;
+  uint8_t c, j;
+  int16_t sample;
+
+  memcpy(head, buf, sizeof(head));
+
+  for (i=0; i < samples; i += gChannels) {
+    for (c=0; c < gChannels; c++) {
+      sample = (i+c < ADPCM_HEAD_SAMPLES) ? head[i+c] : in[i+c];
+
+      if (gGroupsLeft == 0) {
+        // First frame of a block goes into the block header verbatim
+        gChannel[c].mPredicted = sample;
+        *out++ = (uint8_t)sample;
+        *out++ = (uint8_t)(sample >> 8);
+        *out++ = gChannel[c].mIndex;
+        *out++ = 0;
+      } else {
+        gGroup[c][gGroupFill] = sample;
+      }
+    }
+
+    if (gGroupsLeft == 0) {
+      gGroupsLeft = ADPCM_GROUPS_PER_BLOCK;
+      gFrames++;
+      continue;
+    }
+
+    if (++gGroupFill == ADPCM_GROUP_FRAMES) {
+      // 4 bytes per channel, channels take turns, earlier sample in the low nibble
+      for (c=0; c < gChannels; c++) {
+        for (j=0; j < ADPCM_GROUP_FRAMES; j += 2) {
+          *out = _encode_sample(&gChannel[c], gGroup[c][j]);
+          *out++ |= _encode_sample(&gChannel[c], gGroup[c][j+1]) << 4;
+        }
+      }
+      gGroupFill = 0;
+      gGroupsLeft--;
+      gFrames += ADPCM_GROUP_FRAMES;
+    }
+  }
+
+  return out - buf;
+}
+
+#endif // WITH_ADPCM
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,41 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+#ifndef _ADPCM_H_
+#define _ADPCM_H_
+
+#include <inttypes.h>
+
+// IMA ADPCM block layout used for recording. Each block starts with a header per channel
+// holding the first sample verbatim, then 63 groups of 8 samples per channel at 4 bits each.
+#define ADPCM_GROUP_FRAMES      8
+#define ADPCM_GROUPS_PER_BLOCK  63
+#define ADPCM_FRAMES_PER_BLOCK  (1 + ADPCM_GROUPS_PER_BLOCK*ADPCM_GROUP_FRAMES) // 505
+#define ADPCM_BLOCK_ALIGN(ch)   (256U*(ch))
+
+#define WAVE_FORMAT_IMA_ADPCM   0x11
+
+extern void     adpcm_begin(uint8_t channels);
+extern uint16_t adpcm_encode(uint8_t *buf, uint16_t bytes);
+extern uint32_t adpcm_frames(void);
+
+#endif // _ADPCM_H_
+// vim: expandtab ts=2 sw=2 ai cindent
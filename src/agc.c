@@ -0,0 +1,222 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+
+/*
+ * Automatic gain control. Runs once per block of samples (a sector for SD recording, a packet
+ * for SPI capture) rather than per sample:
+ *
+ *   - the block's peak is measured and the gain that would bring it to the target level is
+ *     worked out (limited to AGC_MAX_GAIN so silence does not get amplified without end)
+ *   - the gain moves towards that value with a time constant of 'attack' ms when coming down
+ *     and 'release' ms when going up
+ *   - the block is scaled by the new gain, saturating at full scale
+ *
+ * The gain is 8.8 fixed point. With coarse steps enabled the ADC's own differential gain
+ * (1X/2X/4X/8X) is stepped up when the digital gain reaches 2X and down when it falls below
+ * 0.5X, halving or doubling the digital gain to match. This keeps the digital gain near 1X so
+ * quiet sources get real ADC resolution instead of just bigger numbers. Only recordings whose
+ * channels all share one input's gain are stepped (not four channels, nor stereo mic, whose
+ * second channel is LINE_L).
+ *
+ * Recording to SD processes each sector as soon as DMA has filled it, so the step takes effect
+ * at once and only the sector DMA is filling at the time is partly at the old gain. SPI streaming
+ * can have a buffer or more of packets queued at the old gain, so there the step waits: the ADC
+ * gain changes when DMA moves on to the other buffer (agc_dma_switch()), and the digital gain
+ * follows when the packets get to that buffer (agc_buffer_start()).
+ */
+#include <inttypes.h>
+#include <avr/io.h>
+
+#include "config.h"
+#include "adc.h"
+#include "agc.h"
+
+#if WITH_AGC==1
+
+#define AGC_UNITY     256U        // 1X in 8.8 fixed point
+#define AGC_MAX_GAIN  (16U*AGC_UNITY)
+
+static uint16_t gAGCTarget;       // Target peak level, 0 to disable
+static uint16_t gAGCAttackMs = 10;
+static uint16_t gAGCReleaseMs = 2000;
+static uint8_t gAGCCoarseRequested;
+
+static uint8_t gAGCActive;
+static uint8_t gAGCCoarse;        // Using the ADC gain steps this recording
+static uint8_t gAGCStereo;
+static RecType_t gAGCType;
+static ADCGain_t gAGCADCGain;     // Current ADC gain step
+static uint16_t gAGCGain;         // Current digital gain
+static uint32_t gAGCAttack;       // Time constants in samples (all channels)
+static uint32_t gAGCRelease;
+
+// ADC gain steps aligned with DMA buffers (SPI streaming)
+#define AGC_STEP_NONE     0
+#define AGC_STEP_WAITING  1       // Decided, waiting for DMA to start a buffer
+#define AGC_STEP_APPLIED  2       // ADC stepped, waiting for the packets to get to that buffer
+
+static uint8_t gAGCAligned;
+static uint8_t volatile gAGCStepState;
+static uint8_t volatile gAGCStepBuffer;   // gBuffers[] the new ADC gain starts in
+static ADCGain_t volatile gAGCStepGain;
+
+void agc_set_target(uint16_t level)
+{
+  gAGCTarget = (level > 32767) ? 32767 : level;
+}
+
+void agc_set_attack(uint16_t ms)
+{
+  gAGCAttackMs = ms;
+}
+
+void agc_set_release(uint16_t ms)
+{
+  gAGCReleaseMs = ms;
+}
+
+void agc_set_coarse(uint8_t enable)
+{
+  gAGCCoarseRequested = enable;
+}
+
+static uint32_t _samples(uint16_t ms, uint16_t Fs, uint8_t channels)
+{
+  uint32_t n = ((uint32_t)ms * Fs) / 1000 * channels;
+
+  return n ? n : 1;
+}
+
+// Call once the ADC has been started, since coarse steps begin from the gain it was started with.
+// 'aligned' makes ADC gain steps wait for a DMA buffer boundary (see above).
+void agc_begin(uint16_t Fs, uint8_t channels, RecType_t type, uint8_t aligned)
+{
+  gAGCStepState = AGC_STEP_NONE;
+  gAGCActive = (gAGCTarget != 0);
+  if (! gAGCActive) return;
+
+  gAGCStereo = (channels > 1);
+  gAGCType = type;
+  gAGCAligned = aligned;
+  gAGCGain = AGC_UNITY;
+  gAGCAttack = _samples(gAGCAttackMs, Fs, channels);
+  gAGCRelease = _samples(gAGCReleaseMs, Fs, channels);
+
+  // The ADC gain is only stepped when every channel is at the same input's gain, since the
+  // digital gain that makes up for the step applies to all of them
+  gAGCCoarse = gAGCCoarseRequested && (type != REC_QUAD) && ! (gAGCStereo && (type == REC_MIC));
+  gAGCADCGain = adc_get_gain(type);
+}
+
+// Halve or double the digital gain to make up for an ADC step to 'gain'
+static void _agc_follow(ADCGain_t gain)
+{
+  if (gain > gAGCADCGain) {
+    gAGCGain >>= 1;
+  } else {
+    gAGCGain <<= 1;
+  }
+  gAGCADCGain = gain;
+}
+
+static void _agc_coarse(void)
+{
+  ADCGain_t gain;
+
+  if (gAGCStepState != AGC_STEP_NONE) return;
+
+  if ((gAGCGain >= 2*AGC_UNITY) && (gAGCADCGain < ADC_DIFF_GAIN_8X)) {
+    gain = gAGCADCGain + 1;
+  } else if ((gAGCGain < AGC_UNITY/2) && (gAGCADCGain > ADC_DIFF_GAIN_1X)) {
+    gain = gAGCADCGain - 1;
+  } else {
+    return;
+  }
+
+  if (gAGCAligned) {
+    gAGCStepGain = gain;
+    gAGCStepState = AGC_STEP_WAITING;
+  } else {
+    adc_step_gain(gain, gAGCType, gAGCStereo);
+    _agc_follow(gain);
+  }
+}
+
+// Called from the DMA ISR when DMA has moved on to gBuffers['buffer']
+void agc_dma_switch(uint8_t buffer)
+{
+  if (gAGCStepState != AGC_STEP_WAITING) return;
+
+  adc_step_gain(gAGCStepGain, gAGCType, gAGCStereo);
+  gAGCStepBuffer = buffer;
+  gAGCStepState = AGC_STEP_APPLIED;
+}
+
+// Called before agc_apply() on the first packet of gBuffers['buffer']
+void agc_buffer_start(uint8_t buffer)
+{
+  if ((gAGCStepState != AGC_STEP_APPLIED) || (buffer != gAGCStepBuffer)) return;
+
+  _agc_follow(gAGCStepGain);
+  gAGCStepState = AGC_STEP_NONE;
+}
+
+// Scale a block of samples in place
+void agc_apply(int16_t *samples, uint16_t count)
+{
+  uint16_t n, peak;
+  uint32_t want, tau;
+  int32_t y;
+
+  if (! gAGCActive) return;
+
+  for (peak = 0, n = 0; n < count; n++) {
+    uint16_t a = (samples[n] < 0) ? -(int32_t)samples[n] : samples[n];
+    if (a > peak) peak = a;
+  }
+
+  // Gain that would put this block's peak at the target
+  want = peak ? (((uint32_t)gAGCTarget * AGC_UNITY) / peak) : AGC_MAX_GAIN;
+  if (want > AGC_MAX_GAIN) want = AGC_MAX_GAIN;
+
+  // First-order move towards it: gain += (want-gain)*count/tau
+  tau = (want < gAGCGain) ? gAGCAttack : gAGCRelease;
+  if (count >= tau) {
+    gAGCGain = want;
+  } else {
+    gAGCGain += (int16_t)(((int32_t)want - gAGCGain) * (int32_t)count / (int32_t)tau);
+  }
+
+  if (gAGCCoarse) _agc_coarse();
+
+  if (gAGCGain == AGC_UNITY) return;
+
+  for (n = count; n; n--, samples++) {
+    y = ((int32_t)*samples * gAGCGain) >> 8;
+    if (y > 32767) y = 32767;
+    else if (y < -32768) y = -32768;
+    *samples = y;
+  }
+}
+
+#endif // WITH_AGC
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,38 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+#ifndef _AGC_H_
+#define _AGC_H_
+
+#include <inttypes.h>
+#include "rec.h"
+
+extern void agc_set_target(uint16_t level);
+extern void agc_set_attack(uint16_t ms);
+extern void agc_set_release(uint16_t ms);
+extern void agc_set_coarse(uint8_t enable);
+extern void agc_begin(uint16_t Fs, uint8_t channels, RecType_t type, uint8_t aligned);
+extern void agc_apply(int16_t *samples, uint16_t count);
+extern void agc_dma_switch(uint8_t buffer);
+extern void agc_buffer_start(uint8_t buffer);
+
+#endif // _AGC_H_
+// vim: expandtab ts=2 sw=2 ai cindent
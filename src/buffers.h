@@ -39,10 +39,14 @@ extern void buffers_clear_all(void);
    Bit 0: Set when gBuffers[0] is the last buffer that should play
    Bit 1: Set when gBuffers[1] is the last buffer that should play
    Bit 2: Set when the playback process needs to be kickstarted
+   Bit 3: Set when the kickstart should arm a sample clock alarm rather than start DMA right away
+   Bit 4: Set when playback was stopped by a sample clock alarm and needs to be cleaned up
 */
 #define CTRL_FLAG_BUFFER0_IS_LAST 0x1  // Must be (1<<0) to represent 1<<buffer0
 #define CTRL_FLAG_BUFFER1_IS_LAST 0x2  // Must be (1<<1) to represent 1<<buffer1
 #define CTRL_FLAG_KICKSTART       0x4
+#define CTRL_FLAG_SCHEDULED       0x8
+#define CTRL_FLAG_STOPPED         0x10
 
 extern uint8_t gCtrlFlags;
 
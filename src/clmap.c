@@ -0,0 +1,204 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+
+/*
+ * This module builds a map of the contiguous cluster runs that make up an open file, so that any
+ * file offset can be turned into an absolute sector number without walking the FAT chain again.
+ * FatFs can do this itself (_USE_FASTSEEK) but that is not compiled into the bootloader.
+ *
+ * It is also used for recording straight to the sectors of a presized file (wavwrite.c), and
+ * for relinking the clusters of a black box recording so the oldest audio comes first.
+ *
+ * Only one file is mapped at a time. FAT sectors are read through the FatFs window (fs->win),
+ * exactly as FatFs itself does, so no extra sector buffer is needed and the FatFs cache stays
+ * coherent. FAT12 volumes are not supported.
+ */
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+
+#include "config.h"
+#include "ff.h"
+#include "diskio.h"
+#include "clmap.h"
+
+typedef struct {
+  DWORD mClust;   // First cluster of the run
+  DWORD mCount;   // Number of consecutive clusters in the run
+} ClusterRun_t;
+
+static ClusterRun_t gRuns[CLMAP_MAX_RUNS];
+static uint8_t gNumRuns;
+static FATFS *gFS;
+
+// Bring an absolute sector into the FatFs window and return a pointer to it, or 0 on failure.
+// The window must not be dirty (FatFs has nothing pending for a file that is only being read).
+uint8_t *clmap_window(DWORD sect)
+{
+  if (gFS->winsect != sect) {
+    if (gFS->wflag) return 0;
+    if (disk_read(gFS->drv, gFS->win, sect, 1) != RES_OK) {
+      gFS->winsect = 0xFFFFFFFFUL; // Window contents are now unknown
+      return 0;
+    }
+    gFS->winsect = sect;
+  }
+  return gFS->win;
+}
+
+// Return the FAT entry for a cluster, 1 on error
+static DWORD _next_cluster(DWORD clust)
+{
+  uint8_t *win;
+
+  switch (gFS->fs_type) {
+    case FS_FAT16:
+      if (! (win = clmap_window(gFS->fatbase + (clust >> 8)))) return 1;
+      return *(WORD *)(win + ((uint8_t)clust * 2U));
+
+    case FS_FAT32:
+      if (! (win = clmap_window(gFS->fatbase + (clust >> 7)))) return 1;
+      return *(DWORD *)(win + ((uint8_t)(clust & 0x7F) * 4U)) & 0x0FFFFFFFUL;
+
+    default:
+      return 1;
+  }
+}
+
+// Set the FAT entry for a cluster, in every copy of the FAT. The sector is modified in the
+// window and written straight back, so the window stays clean.
+// Returns 0 if the FAT could not be read or written.
+uint8_t clmap_set_fat(DWORD clust, DWORD val)
+{
+  DWORD sect;
+  uint8_t *win;
+  uint8_t i;
+
+  switch (gFS->fs_type) {
+    case FS_FAT16:
+      sect = gFS->fatbase + (clust >> 8);
+      if (! (win = clmap_window(sect))) return 0;
+      *(WORD *)(win + ((uint8_t)clust * 2U)) = (WORD)val;
+      break;
+
+    case FS_FAT32:
+      sect = gFS->fatbase + (clust >> 7);
+      if (! (win = clmap_window(sect))) return 0;
+      win += (uint8_t)(clust & 0x7F) * 4U;
+      *(DWORD *)win = (*(DWORD *)win & 0xF0000000UL) | (val & 0x0FFFFFFFUL);
+      break;
+
+    default:
+      return 0;
+  }
+
+  for (i=0; i < gFS->n_fats; i++, sect += gFS->fsize) {
+    if (disk_write(gFS->drv, gFS->win, sect, 1) != RES_OK) {
+      gFS->winsect = 0xFFFFFFFFUL;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Map all clusters of an open file. Returns 0 if the file is empty, too fragmented
+// (more than CLMAP_MAX_RUNS runs) or the FAT could not be read.
+uint8_t clmap_build(FIL *fp)
+{
+  ClusterRun_t *run = gRuns;
+  DWORD clust, next;
+
+  gFS = fp->fs;
+  gNumRuns = 0;
+
+  clust = fp->sclust;
+  if (clust < 2) return 0;
+
+  run->mClust = clust;
+  run->mCount = 1;
+  while (1) {
+    next = _next_cluster(clust);
+    if (next < 2) return 0;
+    if (next >= gFS->n_fatent) break; // End of chain
+
+    if (next == clust+1) {
+      run->mCount++;
+    } else {
+      if (++run == gRuns + CLMAP_MAX_RUNS) return 0;
+      run->mClust = next;
+      run->mCount = 1;
+    }
+    clust = next;
+  }
+  gNumRuns = run - gRuns + 1;
+  return 1;
+}
+
+// Find the first run of 'count' free clusters and return its first cluster, or 0 if there is none
+// or the FAT could not be read. Setting fs->last_clust just below it makes FatFs allocate the run.
+DWORD clmap_find_free(FATFS *fs, DWORD count)
+{
+  DWORD clust, next, start = 0, len = 0;
+
+  gFS = fs;
+  for (clust = 2; clust < fs->n_fatent; clust++) {
+    next = _next_cluster(clust);
+    if (next == 1) return 0;
+
+    if (next) {
+      len = 0;
+    } else {
+      if (len++ == 0) start = clust;
+      if (len == count) return start;
+    }
+  }
+  return 0;
+}
+
+// Return the cluster that holds the given file offset, or 0 if it is beyond the mapped clusters
+DWORD clmap_cluster(DWORD ofs)
+{
+  DWORD sect = clmap_sector(ofs, 0);
+
+  return sect ? (sect - gFS->database) / gFS->csize + 2 : 0;
+}
+
+// Return the absolute sector that holds the given file offset, or 0 if it is beyond the
+// mapped clusters. If contig is not null, it receives the number of consecutive sectors,
+// starting with the returned one, before the next fragment.
+DWORD clmap_sector(DWORD ofs, DWORD *contig)
+{
+  ClusterRun_t *run;
+  DWORD sect = ofs / 512;
+  DWORD clust = sect / gFS->csize;
+  uint8_t i;
+
+  sect %= gFS->csize;
+  for (i=0, run=gRuns; i < gNumRuns; i++, run++) {
+    if (clust < run->mCount) {
+      if (contig) *contig = (run->mCount - clust) * gFS->csize - sect;
+      return gFS->database + (run->mClust - 2 + clust) * gFS->csize + sect;
+    }
+    clust -= run->mCount;
+  }
+  return 0;
+}
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,39 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+#ifndef _CLMAP_H_
+#define _CLMAP_H_
+
+#include <inttypes.h>
+#include "ff.h"
+
+// Maximum number of contiguous cluster runs (fragments) a mapped file may have
+#define CLMAP_MAX_RUNS 8
+
+extern uint8_t *clmap_window(DWORD sect);
+extern uint8_t  clmap_build(FIL *fp);
+extern DWORD    clmap_sector(DWORD ofs, DWORD *contig);
+extern DWORD    clmap_find_free(FATFS *fs, DWORD count);
+extern DWORD    clmap_cluster(DWORD ofs);
+extern uint8_t  clmap_set_fat(DWORD clust, DWORD val);
+
+#endif // _CLMAP_H_
+// vim: expandtab ts=2 sw=2 ai cindent
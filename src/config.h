@@ -62,5 +62,35 @@
 // Set to 1 to enable debugging output over the serial port
 #define WITH_DEBUG 1
 
+// Set to 1 to enable the timeline sequencer (seq.c)
+#define WITH_SEQUENCER 1
+
+// Set to 1 to enable IMA ADPCM encoding of recordings (adpcm.c)
+#define WITH_ADPCM 1
+
+// Set to 1 to enable packed 12-bit recording and playback (pack12.c)
+#define WITH_PACK12 1
+
+// Set to 1 to enable voice-activated (VOX) recording to SD (rec.c)
+#define WITH_VOX 1
+
+// Set to 1 to enable cue markers in SD recordings (cue.c)
+#define WITH_CUE 1
+
+// Set to 1 to enable waveform overview (peak) files for SD recordings (peak.c)
+#define WITH_PEAK 1
+
+// Set to 1 to enable the DC-blocking filter for recording and SPI capture (dcblock.c)
+#define WITH_DCBLOCK 1
+
+// Set to 1 to enable automatic gain control for recording and SPI capture (agc.c)
+#define WITH_AGC 1
+
+// Set to 1 to enable decimation for oversampled PCM recording and rate conversion (decim.c)
+#define WITH_DECIM 1
+
+// Set to 1 to enable the SD write latency histogram (sdlat.c)
+#define WITH_SDLAT 1
+
 #endif // _CONFIG_H_
 // vim: expandtab ts=2 sw=2 ai cindent
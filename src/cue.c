@@ -0,0 +1,215 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+
+/*
+ * This module keeps the cue markers set while recording to SD, and writes them to the end of
+ * the WAV file as a 'cue ' chunk plus a 'LIST' 'adtl' chunk labelling them "Mark 1", "Mark 2",
+ * and so on, when the recording is finalized.
+ *
+ * Setting a marker only stores its sample frame position in a RAM table. Once the table is
+ * half full it is spilled, in idle time, to a sidecar file with the recording's name and a .CUE
+ * extension (one 32-bit little-endian frame position per marker), and read back from there at
+ * the end. The sidecar file is removed once its markers are in the WAV file.
+ *
+ * Positions count sample frames from the start of sampling. When they don't match positions in
+ * the WAV file's data, i.e., when VOX drops audio, when a black box ring has wrapped and only
+ * its last window is kept, or after the first file of a rotating recording, the markers are
+ * only written to the sidecar file.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+
+#include "config.h"
+#include "buffers.h"
+#include "ff.h"
+#include "fail.h"
+#include "cue.h"
+
+#if WITH_CUE==1
+
+#define CUE_TABLE_SIZE 16
+#define CUE_SPILL_AT   (CUE_TABLE_SIZE/2)
+
+static uint32_t gCueTable[CUE_TABLE_SIZE]; // Frame positions not yet spilled
+static uint8_t gCueCount;                  // Markers in gCueTable
+static uint16_t gCueSpilled;               // Markers in the sidecar file
+static uint16_t gCueNext;                  // Number of the next marker, 0 if not recording
+static uint8_t gCueFileOpen;
+static uint8_t gCueEmbed;                  // Zero if the markers must stay in the sidecar file
+static FIL gCueFile;
+static char gCueName[13];
+
+// Start keeping markers for a recording. With 'embed' zero the marker positions won't match
+// the WAV file's data, so they are only written to the sidecar file.
+void cue_begin(const char *fname, uint8_t embed)
+{
+  uint8_t i;
+
+  for (i=0; (i < 8) && fname[i] && (fname[i] != '.'); i++) gCueName[i] = fname[i];
+  strcpy_P(gCueName+i, PSTR(".CUE"));
+
+  gCueCount = 0;
+  gCueSpilled = 0;
+  gCueFileOpen = 0;
+  gCueNext = 1;
+  gCueEmbed = embed;
+}
+
+// Add a marker at the given sample frame. Returns the marker number, or 0 if there is no
+// recording or the table is full because spilling it has failed.
+uint16_t cue_mark(uint32_t frame)
+{
+  if (! gCueNext || (gCueCount == CUE_TABLE_SIZE)) return 0;
+
+  gCueTable[gCueCount++] = frame;
+  return gCueNext++;
+}
+
+uint8_t cue_spill_due(void)
+{
+  return gCueNext && (gCueCount >= CUE_SPILL_AT);
+}
+
+// Move the RAM table to the sidecar file. On failure markers stay in RAM until the table fills.
+void cue_spill(void)
+{
+  UINT bytesWritten;
+
+  if (! gCueFileOpen) {
+    if (f_open(&gCueFile, gCueName, FA_READ | FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+      (void) fail(FAIL_REC, FAIL_REC_CUEFILE);
+      return;
+    }
+    gCueFileOpen = 1;
+  }
+
+  if ((f_write(&gCueFile, gCueTable, gCueCount*sizeof(gCueTable[0]), &bytesWritten) != FR_OK)
+      || (bytesWritten != gCueCount*sizeof(gCueTable[0]))) {
+    (void) fail(FAIL_REC, FAIL_REC_CUEFILE);
+    return;
+  }
+  gCueSpilled += gCueCount;
+  gCueCount = 0;
+}
+
+static uint8_t _write(FIL *fp, const void *buf, UINT len)
+{
+  UINT bytesWritten;
+
+  return (f_write(fp, buf, len, &bytesWritten) == FR_OK) && (bytesWritten == len);
+}
+
+// Length of the text of a label, including the terminating null
+static uint8_t _label_len(uint16_t id)
+{
+  char buf[6];
+
+  return 5 + strlen(utoa(id, buf, 10)) + 1;
+}
+
+// Write the 'cue ' and 'LIST' chunks to the file at its current position, which must be just
+// past the data chunk, and return their size in 'bytes'. With no file, or more markers than
+// CUE_MAX_EMBEDDED, the markers are left in the sidecar file instead.
+// Returns 0 if failure, 1 if successful.
+// NOTE: It uses the global ping-pong buffers for temporary storage
+uint8_t cue_finish(FIL *fp, DWORD *bytes)
+{
+  uint32_t *pos = (uint32_t *)gBuffers;
+  uint8_t buf[24];
+  UINT bytesRead;
+  uint16_t count, id;
+  DWORD listBytes;
+  uint8_t len;
+
+  *bytes = 0;
+  if (! gCueNext) return 1;
+  gCueNext = 0;
+  if (! gCueEmbed) fp = 0;
+
+  // Everything goes to the sidecar file if it is there already or the markers can't be embedded
+  if (gCueFileOpen || ! fp) {
+    if (gCueCount) cue_spill();
+    if (gCueCount) return 0;
+  }
+
+  if (! gCueFileOpen) {
+    count = gCueCount;
+    memcpy(pos, gCueTable, count*sizeof(gCueTable[0]));
+  } else {
+    count = 0;
+    if (fp && (gCueSpilled <= CUE_MAX_EMBEDDED)) {
+      if ((f_lseek(&gCueFile, 0) != FR_OK)
+          || (f_read(&gCueFile, pos, gCueSpilled*sizeof(gCueTable[0]), &bytesRead) != FR_OK)
+          || (bytesRead != gCueSpilled*sizeof(gCueTable[0]))) {
+        (void) f_close(&gCueFile);
+        return fail(FAIL_REC, FAIL_REC_CUEFILE);
+      }
+      count = gCueSpilled;
+    }
+    (void) f_close(&gCueFile);
+    if (! count) return 1; // Markers are left in the sidecar file
+    (void) f_unlink(gCueName);
+  }
+  if (! count) return 1;
+
+  // 'cue ' chunk: a cue point per marker, all within the data chunk
+  memcpy_P(buf, PSTR("cue "), 4);
+  *(uint32_t *)(buf+4) = 4 + 24UL*count;
+  *(uint32_t *)(buf+8) = count;
+  if (! _write(fp, buf, 12)) return fail(FAIL_REC, FAIL_REC_CUEFILE);
+
+  memset(buf, 0, sizeof(buf));
+  memcpy_P(buf+8, PSTR("data"), 4);
+  for (id=1; id <= count; id++) {
+    *(uint32_t *)(buf+0) = id;
+    *(uint32_t *)(buf+4) = pos[id-1];
+    *(uint32_t *)(buf+20) = pos[id-1];
+    if (! _write(fp, buf, 24)) return fail(FAIL_REC, FAIL_REC_CUEFILE);
+  }
+
+  // 'LIST' chunk of 'labl' chunks
+  listBytes = 4;
+  for (id=1; id <= count; id++) listBytes += 12 + ((_label_len(id) + 1) & ~1);
+
+  memcpy_P(buf, PSTR("LIST    adtl"), 12);
+  *(uint32_t *)(buf+4) = listBytes;
+  if (! _write(fp, buf, 12)) return fail(FAIL_REC, FAIL_REC_CUEFILE);
+
+  for (id=1; id <= count; id++) {
+    len = _label_len(id);
+    memcpy_P(buf, PSTR("labl"), 4);
+    *(uint32_t *)(buf+4) = 4 + len;
+    *(uint32_t *)(buf+8) = id;
+    strcpy_P((char *)buf+12, PSTR("Mark "));
+    utoa(id, (char *)buf+17, 10);
+    buf[12+len] = 0; // Pad byte, if needed
+    if (! _write(fp, buf, 12 + ((len + 1) & ~1))) return fail(FAIL_REC, FAIL_REC_CUEFILE);
+  }
+
+  *bytes = 12 + 24UL*count + 8 + listBytes;
+  return 1;
+}
+
+#endif // WITH_CUE
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,38 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+#ifndef _CUE_H_
+#define _CUE_H_
+
+#include <inttypes.h>
+#include "ff.h"
+
+// Most markers that can go into the 'cue ' chunk. More are only kept in the .CUE file.
+#define CUE_MAX_EMBEDDED 256
+
+extern void     cue_begin(const char *fname, uint8_t embed);
+extern uint16_t cue_mark(uint32_t frame);
+extern uint8_t  cue_spill_due(void);
+extern void     cue_spill(void);
+extern uint8_t  cue_finish(FIL *fp, DWORD *bytes);
+
+#endif // _CUE_H_
+// vim: expandtab ts=2 sw=2 ai cindent
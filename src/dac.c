@@ -55,4 +55,13 @@ void dac_init(void)
 #endif
 }
 
+// Write mid-scale ("0V") directly to the DAC outputs, e.g., when DMA is stopped mid-buffer
+void dac_silence(void)
+{
+  DACB.CH0DATA = 0x8000U;
+#if WITH_DAC_RIGHT==1
+  DACB.CH1DATA = 0x8000U;
+#endif
+}
+
 // vim: expandtab ts=2 ai sw=2 cindent
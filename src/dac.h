@@ -23,6 +23,7 @@
 #define _DAC_H_
 
 extern void dac_init(void);
+extern void dac_silence(void);
 
 #endif // _DAC_H_
 // vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,111 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+
+/*
+ * This module removes the DC offset from recorded samples with a first-order high-pass filter:
+ * a leaky integrator tracks the DC level of each channel and is subtracted from it,
+ *
+ *   dc += (x - dc) / 256,  y = x - dc
+ *
+ * The corner frequency is Fs/(2*pi*256), e.g., 27 Hz at 44.1 kHz. The DC level is kept in
+ * 24.8 fixed point so dividing by 256 is just dropping a byte. Filter state carries over from
+ * one block to the next for the whole recording.
+ *
+ * Time spent filtering is measured with the stopwatch, so the cost per sample can be read back:
+ * cycles per sample = ticks * STOPWATCH_CLOCKS_PER_TICK / samples.
+ */
+#include <inttypes.h>
+
+#include "config.h"
+#include "timer.h"
+#include "dcblock.h"
+
+#if WITH_DCBLOCK==1
+
+static uint8_t gDCRequested;   // Set by dcblock_set()
+static uint8_t gDCActive;      // Filtering the recording in progress
+static uint8_t gDCChannels;
+static int32_t gDCLevel[4];    // DC level of each channel times 256
+static uint32_t gDCSamples;    // Samples filtered this recording
+static uint32_t gDCTicks;      // Stopwatch() ticks spent filtering them
+
+void dcblock_set(uint8_t enable)
+{
+  gDCRequested = enable;
+}
+
+void dcblock_begin(uint8_t channels)
+{
+  uint8_t ch;
+
+  gDCActive = gDCRequested;
+  gDCChannels = channels;
+  for (ch=0; ch < 4; ch++) gDCLevel[ch] = 0;
+  gDCSamples = gDCTicks = 0;
+}
+
+static inline int16_t _filter(int16_t x, int32_t *level)
+{
+  int32_t y;
+
+  *level += x - (*level >> 8);
+  y = x - (*level >> 8);
+
+  if (y > 32767) return 32767;
+  if (y < -32768) return -32768;
+  return y;
+}
+
+// Filter a block of samples in place. A block must hold whole frames.
+void dcblock_apply(int16_t *samples, uint16_t count)
+{
+  uint16_t start, n;
+  uint8_t ch;
+
+  if (! gDCActive) return;
+
+  start = Stopwatch();
+  if (gDCChannels > 1) {
+    for (n = count/gDCChannels; n; n--) {
+      for (ch=0; ch < gDCChannels; ch++) {
+        *samples = _filter(*samples, &gDCLevel[ch]);
+        samples++;
+      }
+    }
+  } else {
+    for (n = count; n; n--) {
+      *samples = _filter(*samples, &gDCLevel[0]);
+      samples++;
+    }
+  }
+  gDCTicks += (uint16_t)(Stopwatch() - start);
+  gDCSamples += count;
+}
+
+void dcblock_get_cost(uint32_t *samples, uint32_t *ticks)
+{
+  *samples = gDCSamples;
+  *ticks = gDCTicks;
+}
+
+#endif // WITH_DCBLOCK
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,174 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+
+/*
+ * Decimation by 2, 4 or 8, for oversampled recordings and for capturing at a higher rate than
+ * is stored or streamed. Two stages:
+ *
+ *   - a third-order CIC (cascaded integrator-comb) filter takes care of all but the last factor
+ *     of 2. It needs no multiplications: the integrators run at the ADC rate and the combs at
+ *     the CIC's output rate, in 32-bit arithmetic that is allowed to wrap, which the combs undo.
+ *     Its gain of 4^3 at most leaves room in 32 bits for 16-bit input.
+ *   - a 39-tap halfband FIR filter does the last factor of 2, polyphase: only every other
+ *     output is worked out. Every other coefficient of a halfband filter is zero and the rest
+ *     are symmetric, so an output takes 10 multiplications. It is flat to 0.4 of the output
+ *     rate and down 60 dB from 0.6 of the output rate on, so nothing aliases into the 0-0.4
+ *     band. The CIC droops less than 3 dB up to there since it only decimates to twice the
+ *     output rate.
+ *
+ * Averaging the ADC's noise over more samples also gives extra resolution. See decimsim.py for
+ * SNR, alias rejection and cycle estimates.
+ *
+ * Samples are decimated in place: the output of a block goes to the start of the block. All
+ * filter state carries over from one block to the next.
+ */
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+
+#include "config.h"
+#include "decim.h"
+
+#if WITH_DECIM==1
+
+#define DECIM_ORDER 3   // CIC stages
+#define DECIM_TAPS  39  // Halfband filter length
+#define DECIM_PAIRS 10  // Non-zero coefficient pairs either side of the centre tap
+
+// Halfband coefficients (Kaiser window, beta 6) either side of the centre tap, working
+// outwards, doubled, in Q15. The centre tap is 0.5. They add up to 0.5 (16384).
+static const int16_t gHalfband[DECIM_PAIRS] PROGMEM = {
+  20703, -6492, 3441, -2031, 1212, -698, 374, -178, 69, -16
+};
+
+typedef struct {
+  uint32_t mInteg[DECIM_ORDER];
+  uint32_t mComb[DECIM_ORDER];
+  int16_t  mHist[DECIM_TAPS];   // Halfband filter input, a ring
+} DecimState_t;
+
+static DecimState_t gDecim[2];  // Per channel
+static uint8_t gDecimStereo;
+static uint8_t gDecimCICShift;  // log2 of the CIC decimation factor
+static uint8_t gDecimCICPhase;  // CIC input samples (frames) since the last CIC output
+static uint8_t gDecimPos;       // Newest sample in mHist[]
+static uint8_t gDecimHBPhase;   // Set when the next halfband input makes an output
+
+void decim_begin(uint8_t shift, uint8_t stereo)
+{
+  uint8_t i, ch;
+
+  gDecimStereo = stereo ? 1 : 0;
+  gDecimCICShift = shift ? shift-1 : 0;
+  gDecimCICPhase = 0;
+  gDecimPos = 0;
+  gDecimHBPhase = 0;
+  for (ch=0; ch < 2; ch++) {
+    for (i=0; i < DECIM_ORDER; i++) gDecim[ch].mInteg[i] = gDecim[ch].mComb[i] = 0;
+    for (i=0; i < DECIM_TAPS; i++) gDecim[ch].mHist[i] = 0;
+  }
+}
+
+static inline void _integrate(DecimState_t *s, int16_t x)
+{
+  s->mInteg[0] += (int32_t)x;
+  s->mInteg[1] += s->mInteg[0];
+  s->mInteg[2] += s->mInteg[1];
+}
+
+static inline int16_t _comb(DecimState_t *s)
+{
+  uint32_t x, y;
+  uint8_t i;
+
+  x = s->mInteg[DECIM_ORDER-1];
+  for (i=0; i < DECIM_ORDER; i++) {
+    y = x - s->mComb[i];
+    s->mComb[i] = x;
+    x = y;
+  }
+  return (int16_t)((int32_t)x >> (DECIM_ORDER*gDecimCICShift));
+}
+
+// Halfband filter output for the newest sample in mHist[]. Tap n is n samples older than the
+// newest; taps 18-2k and 20+2k share coefficient k.
+static int16_t _halfband(const DecimState_t *s)
+{
+  int8_t a, b, centre;
+  uint8_t k;
+  int16_t c, pair;
+  int32_t acc;
+
+  centre = gDecimPos - DECIM_TAPS/2;
+  if (centre < 0) centre += DECIM_TAPS;
+  acc = ((int32_t)s->mHist[centre] << 14) + (1 << 14);
+
+  a = centre + 1;
+  if (a == DECIM_TAPS) a = 0;
+  b = centre - 1;
+  if (b < 0) b += DECIM_TAPS;
+  for (k=0; k < DECIM_PAIRS; k++) {
+    c = pgm_read_word(&gHalfband[k]);
+    pair = (s->mHist[a] >> 1) + (s->mHist[b] >> 1);
+    acc += (int32_t)c * pair;
+    a += 2;
+    if (a >= DECIM_TAPS) a -= DECIM_TAPS;
+    b -= 2;
+    if (b < 0) b += DECIM_TAPS;
+  }
+
+  acc >>= 15;
+  if (acc > 32767) return 32767;
+  if (acc < -32768) return -32768;
+  return acc;
+}
+
+// Decimate 'count' samples (whole frames if stereo), which need not be a multiple of the
+// decimation factor. Returns the number of samples now at the start of the block.
+uint16_t decim_run(int16_t *samples, uint16_t count)
+{
+  const int16_t *in = samples;
+  int16_t *out = samples;
+  uint8_t mask = (1 << gDecimCICShift) - 1;
+  uint8_t ch;
+  int16_t x[2];
+
+  for (count >>= gDecimStereo; count; count--) {
+    for (ch=0; ch <= gDecimStereo; ch++) x[ch] = *in++;
+
+    if (mask) {
+      for (ch=0; ch <= gDecimStereo; ch++) _integrate(&gDecim[ch], x[ch]);
+      if ((++gDecimCICPhase & mask) != 0) continue;
+      for (ch=0; ch <= gDecimStereo; ch++) x[ch] = _comb(&gDecim[ch]);
+    }
+
+    if (++gDecimPos == DECIM_TAPS) gDecimPos = 0;
+    for (ch=0; ch <= gDecimStereo; ch++) gDecim[ch].mHist[gDecimPos] = x[ch];
+    gDecimHBPhase ^= 1;
+    if (gDecimHBPhase) continue;
+
+    for (ch=0; ch <= gDecimStereo; ch++) *out++ = _halfband(&gDecim[ch]);
+  }
+  return out - samples;
+}
+
+#endif // WITH_DECIM
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,34 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+#ifndef _DECIM_H_
+#define _DECIM_H_
+
+#include <inttypes.h>
+
+// Largest decimation factor, as log2
+#define DECIM_MAX_SHIFT 3
+
+extern void     decim_begin(uint8_t shift, uint8_t stereo);
+extern uint16_t decim_run(int16_t *samples, uint16_t count);
+
+#endif // _DECIM_H_
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -1,35 +1,56 @@
-adc.o: adc.c config.h rec.h ff.h integer.h ffconf.h functable.h timer.h \
- sio.h utils.h state.h adc.h
+adc.o: adc.c config.h rec.h ff.h integer.h ffconf.h functable.h adcplan.h \
+ timer.h sio.h utils.h state.h fail.h rateclock.h adc.h
+adpcm.o: adpcm.c config.h adpcm.h
+agc.o: agc.c config.h adc.h rec.h ff.h integer.h ffconf.h functable.h \
+ adcplan.h agc.h
 bootloader.o: bootloader.c config.h bootloader.h
 buffers.o: buffers.c buffers.h config.h
+clmap.o: clmap.c config.h ff.h integer.h ffconf.h functable.h diskio.h \
+ clmap.h
 clocks.o: clocks.c config.h main.h utils.h clocks.h
-dac.o: dac.c config.h rec.h ff.h integer.h ffconf.h functable.h timer.h \
- sio.h utils.h dac.h
+cue.o: cue.c config.h buffers.h ff.h integer.h ffconf.h functable.h \
+ fail.h cue.h
+dac.o: dac.c config.h rec.h ff.h integer.h ffconf.h functable.h adcplan.h \
+ timer.h sio.h utils.h dac.h
+dcblock.o: dcblock.c config.h timer.h dcblock.h
+decim.o: decim.c config.h decim.h
 dma.o: dma.c config.h buffers.h state.h dac.h play.h ff.h integer.h \
- ffconf.h functable.h rec.h dma.h
+ ffconf.h functable.h rec.h adcplan.h dma.h
 fail.o: fail.c config.H fail.h
-ff.o: ff.c config.h fail.h diskio.h integer.h functable.h ff.h ffconf.h
+ff.o: ff.c config.h fail.h diskio.h integer.h functable.h ff.h ffconf.h \
+ wavwrite.h sdlat.h
 i2c.o: i2c.c config.h timer.h i2c.h
 main.o: main.c sio.h utils.h timer.h config.h clocks.h adc.h rec.h ff.h \
- integer.h ffconf.h functable.h dac.h buffers.h state.h play.h \
- spi_C_slave.h i2c.h diskio.h fail.h printf.h
+ integer.h ffconf.h functable.h adcplan.h dac.h buffers.h state.h play.h \
+ spi_C_slave.h i2c.h diskio.h fail.h printf.h seq.h
+pack12.o: pack12.c config.h pack12.h
 pass.o: pass.c config.h dma.h state.h buffers.h rec.h ff.h integer.h \
- ffconf.h functable.h adc.h rateclock.h i2c.h play.h pass.h
+ ffconf.h functable.h adcplan.h adc.h rateclock.h i2c.h play.h pass.h
+peak.o: peak.c config.h ff.h integer.h ffconf.h functable.h fail.h peak.h
 play.o: play.c config.h ff.h integer.h ffconf.h functable.h adc.h rec.h \
- sio.h utils.h buffers.h state.h rateclock.h play.h dma.h i2c.h wavread.h
+ adcplan.h sio.h utils.h buffers.h state.h rateclock.h play.h dma.h i2c.h \
+ dac.h wavread.h timer.h fail.h
 printf.o: printf.c config.h printf.h sio.h
-rateclock.o: rateclock.c config.h rateclock.h
+rateclock.o: rateclock.c config.h fail.h play.h ff.h integer.h ffconf.h \
+ functable.h rateclock.h adcplan.h
 rec.o: rec.c config.h ff.h integer.h ffconf.h functable.h adc.h rec.h \
- buffers.h state.h wavread.h wavwrite.h dma.h rateclock.h fail.h
+ adcplan.h buffers.h state.h wavread.h wavwrite.h dma.h rateclock.h \
+ fail.h adpcm.h pack12.h cue.h peak.h dcblock.h agc.h decim.h timer.h \
+ sdlat.h
+sdlat.o: sdlat.c config.h timer.h sdlat.h
+seq.o: seq.c config.h ff.h integer.h ffconf.h functable.h fail.h state.h \
+ play.h rateclock.h adcplan.h seq.h
 sio.o: sio.c config.h sio.h
 spi_C_slave.o: spi_C_slave.c config.h i2c.h version.c sio.h play.h ff.h \
- integer.h ffconf.h functable.h rec.h fail.h state.h spi_C_slave.h adc.h \
- pass.h bootloader.h wavwrite.h
+ integer.h ffconf.h functable.h rec.h adcplan.h fail.h state.h \
+ spi_C_slave.h adc.h pass.h bootloader.h wavwrite.h rateclock.h seq.h \
+ timer.h cue.h peak.h dcblock.h agc.h sdlat.h
 state.o: state.c config.h state.h
 timer.o: timer.c timer.h config.h diskio.h integer.h functable.h
 utils.o: utils.c sio.h utils.h
 version.o: version.c
 wavread.o: wavread.c config.h buffers.h wavread.h ff.h integer.h ffconf.h \
- functable.h fail.h
+ functable.h diskio.h clmap.h pack12.h fail.h rateclock.h adcplan.h
 wavwrite.o: wavwrite.c config.h buffers.h wavread.h ff.h integer.h \
- ffconf.h functable.h wavwrite.h fail.h
+ ffconf.h functable.h wavwrite.h diskio.h clmap.h fail.h timer.h adpcm.h \
+ pack12.h cue.h sdlat.h
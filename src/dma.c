@@ -45,6 +45,7 @@ void dma_init(void)
 }
 #endif
 
+// 'stereo' is 0 for mono, 1 for stereo, or REC_STEREO_QUAD for four-channel recording
 void dma_begin(DMAConfig_t config, uint8_t stereo)
 {
   uint16_t addr;
@@ -56,7 +57,7 @@ void dma_begin(DMAConfig_t config, uint8_t stereo)
   DMA.CTRL = DMA_CH_ENABLE_bm | DMA_DBUFMODE_CH01_gc;
   DMA.INTFLAGS = 0xFF; // Clear all interrupt flags
   
-  // Configure Channel 0 to be enabled, 2/4-byte burst mode (to read mono/stereo
+  // Configure Channel 0 to be enabled, 2/4/8-byte burst mode (to read mono/stereo/four-channel
   // 16-bit samples), unlimited repeat, only a burst transfer on transfer
   // trigger, clear ERRIF and TRNIF flags, no interrupt on error, HIGH priority
   // interrupt on transfer complete, reload source after each block, increment
@@ -64,7 +65,10 @@ void dma_begin(DMAConfig_t config, uint8_t stereo)
   // trigger DMA transfer on Event Channel 0 (TCC0 setting sample rate) We use
   DMA.CH0.REPCNT = 0;
   DMA.CH1.REPCNT = 0; // Unlimited repeat
-  if (stereo) {
+  if (stereo == REC_STEREO_QUAD) {
+    DMA.CH0.CTRLA = DMA_CH_REPEAT_bm | DMA_CH_BURSTLEN_8BYTE_gc | DMA_CH_SINGLE_bm;
+    DMA.CH1.CTRLA = DMA_CH_REPEAT_bm | DMA_CH_BURSTLEN_8BYTE_gc | DMA_CH_SINGLE_bm;
+  } else if (stereo) {
     DMA.CH0.CTRLA = DMA_CH_REPEAT_bm | DMA_CH_BURSTLEN_4BYTE_gc | DMA_CH_SINGLE_bm;
     DMA.CH1.CTRLA = DMA_CH_REPEAT_bm | DMA_CH_BURSTLEN_4BYTE_gc | DMA_CH_SINGLE_bm;
   } else {
@@ -99,8 +103,9 @@ void dma_begin(DMAConfig_t config, uint8_t stereo)
     case DMA_CFG_RECORD:
       DMA.CH0.ADDRCTRL = DMA_CH_SRCRELOAD_BURST_gc | DMA_CH_SRCDIR_INC_gc | DMA_CH_DESTRELOAD_BLOCK_gc | DMA_CH_DESTDIR_INC_gc;
       DMA.CH1.ADDRCTRL = DMA_CH_SRCRELOAD_BURST_gc | DMA_CH_SRCDIR_INC_gc | DMA_CH_DESTRELOAD_BLOCK_gc | DMA_CH_DESTDIR_INC_gc;
-      DMA.CH0.TRIGSRC = DMA_CH_TRIGSRC_ADCA_CH1_gc;
-      DMA.CH1.TRIGSRC = DMA_CH_TRIGSRC_ADCA_CH1_gc;
+      // Burst of CH0RES-CH1RES (or CH0RES-CH3RES) when the last channel of the sweep is done
+      DMA.CH0.TRIGSRC = (stereo == REC_STEREO_QUAD) ? DMA_CH_TRIGSRC_ADCA_CH3_gc : DMA_CH_TRIGSRC_ADCA_CH1_gc;
+      DMA.CH1.TRIGSRC = (stereo == REC_STEREO_QUAD) ? DMA_CH_TRIGSRC_ADCA_CH3_gc : DMA_CH_TRIGSRC_ADCA_CH1_gc;
       addr = (uint16_t) gBuffers[0];
       DMA.CH0.DESTADDR0 = (addr % 256);
       DMA.CH0.DESTADDR1 = (addr >> 8);
@@ -162,6 +167,7 @@ ISR(DMA_CH0_vect)
       play_dma_ch0_isr(); 
       break;
 
+    case STATE_RECORDING_TO_SD:
     case STATE_RECORDING_TO_SPI:
       rec_dma_isr();
       break;
@@ -184,6 +190,7 @@ ISR(DMA_CH1_vect)
       play_dma_ch1_isr(); 
       break;
 
+    case STATE_RECORDING_TO_SD:
     case STATE_RECORDING_TO_SPI:
       rec_dma_isr();
       break;
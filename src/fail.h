@@ -35,6 +35,8 @@ typedef enum {
   FAIL_MOUNT,
   FAIL_MKFS,
   FAIL_WAV_PRESIZE,
+  FAIL_SEQ,
+  FAIL_RATE,
 } FailMajor_t;
 
 typedef enum {
@@ -57,6 +59,19 @@ typedef enum {
   FAIL_MKFS_FAILED,
   FAIL_MKFS_BAD_CODE,
   FAIL_WAV_TRUNCATE,
+  FAIL_SEQ_NO_FILE,
+  FAIL_SEQ_NO_TIMEBASE,
+  FAIL_WAV_NO_REVERSE,
+  FAIL_REC_FULL,
+  FAIL_REC_CHECKPOINT,
+  FAIL_REC_GAPFILE,
+  FAIL_WAV_RELINK,
+  FAIL_REC_CUEFILE,
+  FAIL_REC_PEAKFILE,
+  FAIL_REC_RATE,
+  FAIL_RATE_CLOCK,
+  FAIL_RATE_ADC,
+  FAIL_REC_DEGRADED,
 } FailMinor_t;
 
 extern uint8_t gFailMajor, gFailMinor;
@@ -29,6 +29,8 @@
 #include "fail.h"
 #include "diskio.h"
 #include "ff.h"
+#include "wavwrite.h"
+#include "sdlat.h"
 
 static FATFS FSObject;
 
@@ -40,6 +42,14 @@ void sd_init(uint8_t prescale)
       fail_nofail();
       //fail(FAIL_MOUNT, FAIL_MOUNT_SUCCESS);
 
+      // Fix up a recording that was interrupted last time
+      wav_repair();
+
+#if WITH_SDLAT==1
+      // Write latencies are per card
+      sdlat_reset();
+#endif
+
       // Take a number from 0 to 7 and map it to bit 7, plus bits 2-1 so we
       // implement CLK2X and PRESCALER[1:0] bits.
       if (prescale & _BV(2)) prescale |= (uint8_t)0x80U;
@@ -41,8 +41,8 @@
  * Timer usage:
  *
  *      TCC0 : Generates Event 0, sampling rate on TCC0 overflow
- *      TCC1 : not used
- *      TCD0 : not used
+ *      TCC1 : Counts Event 0 to form the sample clock, CCA/CCB are start/stop alarms
+ *      TCD0 : Free-running stopwatch for benchmarks (timer.c)
  *      TCD1 : not used
  *      TCE0 : not used
  *
@@ -50,6 +50,7 @@
  *     * SPI from Arduino -- HIGH LEVEL (medium priority among HIGH LEVEL)
  *     * ADC for Line/Mic -- HIGH LEVEL (lowest priority among HIGH LEVEL)
  *     * DMA -- HIGH LEVEL (highest priority among HIGH LEVEL)
+ *     * TCC1 sample clock overflow and alarms -- HIGH LEVEL (rateclock.c)
  *
  *     * USART -- MEDIUM LEVEL
  *       When WITH_SIO_INTERRUPTS is defined, generates interrupts on character
@@ -80,6 +81,7 @@
 #include "diskio.h"
 #include "fail.h"
 #include "printf.h"
+#include "seq.h"
 
 static void set_all_inputs(void)
 {
@@ -102,6 +104,7 @@ static void set_all_inputs(void)
   PORTA.PIN7CTRL = PORT_OPC_TOTEM_gc | PORT_ISC_INPUT_DISABLE_gc;
   PORTA.PIN6CTRL = PORT_OPC_TOTEM_gc | PORT_ISC_INPUT_DISABLE_gc;
   PORTA.PIN5CTRL = PORT_OPC_TOTEM_gc | PORT_ISC_INPUT_DISABLE_gc;
+  PORTA.PIN3CTRL = PORT_OPC_TOTEM_gc | PORT_ISC_INPUT_DISABLE_gc; // Auxiliary input (four-channel recording)
 
   // Enable microphone output by negating !SHDN
   // Only necessary on Rev. A hardware. Rev. B hardware has this always enabled (can shutdown over I2C)
@@ -137,8 +140,8 @@ int main(void)
   PR.PRPB  = PR_ADC_bm; // Don't need ADC on Port B
 
   // NOTE!!! Many timers are being disabled below! We currently don't need them.
-  PR.PRPC  = PR_TC1_bm | PR_HIRES_bm | PR_USART0_bm | PR_USART1_bm | PR_TWI_bm; // Don't need TWI on Port C -- we just bit-bang it
-  PR.PRPD  = PR_TC0_bm | PR_TC1_bm | PR_HIRES_bm | PR_USART0_bm | PR_USART1_bm | PR_TWI_bm;
+  PR.PRPC  = PR_HIRES_bm | PR_USART0_bm | PR_USART1_bm | PR_TWI_bm; // Don't need TWI on Port C -- we just bit-bang it
+  PR.PRPD  = PR_TC1_bm | PR_HIRES_bm | PR_USART0_bm | PR_USART1_bm | PR_TWI_bm;
   PR.PRPE  = PR_TC0_bm | PR_HIRES_bm | PR_TWI_bm
 #if WITH_SIO==0
             | PR_USART0_bm
@@ -155,6 +158,7 @@ int main(void)
 
   // Initialize the timer.
   TimerInit();
+  StopwatchInit();
 
   // Enable interrupts, thus enable serial communication (if interrupt-driven)
   // Enable low-level interrupts, as timer is low-level.
@@ -222,12 +226,20 @@ int main(void)
     ;
 #endif    
 
+#if WITH_SEQUENCER==1
+    seq_update();
+#endif
+
     // Check for flushing buffers
     switch (gState) {
       case STATE_RECORDING_TO_SD:
         rec_flush_buffer();
         break;
 
+      case STATE_RECORDING_TO_SPI:
+        rec_SPI_process_buffer();
+        break;
+
       case STATE_PLAYING_FROM_SD:
         play_fill_buffer();
         break;
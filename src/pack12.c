@@ -0,0 +1,84 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+
+/*
+ * This module packs 16-bit samples into 12 bits for recording, and unpacks them again for
+ * playback. The ADC only produces 12 significant bits (left-adjusted), so this saves a quarter
+ * of the SD card bandwidth with no loss.
+ *
+ * Each pair of consecutive samples a, b (for stereo, the left and right samples of one frame)
+ * is stored in 3 bytes, least-significant first, as the 24-bit value (b>>4)<<12 | (a>>4):
+ *
+ *   byte 0: a[11:4]    byte 1: b[7:4] a[15:12]    byte 2: b[15:8]
+ *
+ * Both directions work in place.
+ */
+#include <inttypes.h>
+
+#include "config.h"
+#include "pack12.h"
+
+#if WITH_PACK12==1
+
+// Pack 'bytes' bytes of 16-bit samples (a multiple of 4) in place. Returns the packed size.
+uint16_t pack12_pack(uint8_t *buf, uint16_t bytes)
+{
+  const uint8_t *in = buf;
+  uint8_t *out = buf;
+  uint8_t a0, a1, b0, b1;
+
+  // Each output triple is written after its input has been read and never gets past the
+  // next unread input, so in place is safe
+  for ( ; bytes >= 4; bytes -= 4) {
+    a0 = *in++; a1 = *in++;
+    b0 = *in++; b1 = *in++;
+    *out++ = (a1 << 4) | (a0 >> 4);
+    *out++ = (b0 & 0xF0) | (a1 >> 4);
+    *out++ = b1;
+  }
+  return out - buf;
+}
+
+// Unpack 'bytes' bytes of packed data (a multiple of 3), which must be at the END of a buffer
+// of PACK12_UNPACKED_SIZE(bytes) bytes, into 16-bit samples filling that buffer from the start.
+// Returns the unpacked size.
+uint16_t pack12_unpack(uint8_t *buf, uint16_t bytes)
+{
+  uint16_t size = PACK12_UNPACKED_SIZE(bytes);
+  const uint8_t *in = buf + size - bytes;
+  uint8_t *out = buf;
+  uint8_t p0, p1, p2;
+
+  // Output runs 4 bytes per 3 of input but starts a quarter of the buffer behind, so it only
+  // catches up with the input at the very end
+  for ( ; bytes >= 3; bytes -= 3) {
+    p0 = *in++; p1 = *in++; p2 = *in++;
+    *out++ = p0 << 4;
+    *out++ = (p1 << 4) | (p0 >> 4);
+    *out++ = p1 & 0xF0;
+    *out++ = p2;
+  }
+  return size;
+}
+
+#endif // WITH_PACK12
+// vim: expandtab ts=2 sw=2 ai cindent
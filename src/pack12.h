@@ -0,0 +1,39 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+#ifndef _PACK12_H_
+#define _PACK12_H_
+
+#include <inttypes.h>
+
+// Format tag of the packed 12-bit WAV layout. This is not a registered format: tools have to
+// know about it (see unpack12.py). Each block of 3*channels bytes holds two sample frames.
+#define WAVE_FORMAT_PACKED12  0x5243  // "RC"
+
+// Packed size of a number of bytes of 16-bit samples, and vice versa
+#define PACK12_PACKED_SIZE(bytes)   ((bytes)/4*3)
+#define PACK12_UNPACKED_SIZE(bytes) ((bytes)/3*4)
+
+extern uint16_t pack12_pack(uint8_t *buf, uint16_t bytes);
+extern uint16_t pack12_unpack(uint8_t *buf, uint16_t bytes);
+
+#endif // _PACK12_H_
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -42,6 +42,10 @@ static int16_t *gPassBufferPtr;
 // playback when possible, or doing direct-to-DAC when not.
 void pass_through(uint8_t effect, uint16_t Fs, uint8_t stereo, uint8_t source)
 {
+  RecType_t type = source ? REC_MIC : REC_LINE;
+
+  if (! adc_rate_ok(Fs, type)) return;
+
   gState = STATE_PASS_THROUGH;
 
   gEffect = effect;
@@ -54,9 +58,9 @@ void pass_through(uint8_t effect, uint16_t Fs, uint8_t stereo, uint8_t source)
 
   // Rate clock will trigger ADC conversions and DMA transactions. We will enable DMA, however, only
   // after we have some samples to play.
-  adc_start(source ? REC_MIC : REC_LINE);
+  (void) adc_start(type, Fs);
   dma_begin(DMA_CFG_PLAY, stereo);
-  rateclock_start(Fs);
+  (void) rateclock_start(Fs);
 
 #if 0 // r1: let user fully control OutputEnable to avoid clicks and pops
   I2C_shutdown_enable(0);
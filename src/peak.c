@@ -0,0 +1,220 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+
+/*
+ * This module writes a waveform overview of an SD recording to a sidecar file with the
+ * recording's name and a .PEK extension, so a host can draw hours of audio without reading the
+ * WAV file. The file starts with an 8-byte header:
+ *
+ *   "PEAK", 16-bit sample frames per entry, 8-bit number of channels, 0
+ *
+ * followed by one entry per that many frames: the minimum then the maximum sample (all
+ * channels together) as signed 8-bit values, i.e., the high byte of the 16-bit
+ * samples.
+ *
+ * Samples are scanned as DMA fills each sector (rec.c) and entries collect in a RAM table that
+ * is written to the file in idle time. The ')' SPI command reads entries back, from the file
+ * or the table, for the recording in progress or the last one. While recording, only the table
+ * is read, as reading the file would hold up the recorder's writes, so a host following a
+ * recording as it goes has to fetch entries before they are spilled.
+ */
+#include <string.h>
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+
+#include "config.h"
+#include "ff.h"
+#include "fail.h"
+#include "peak.h"
+
+#if WITH_PEAK==1
+
+#define PEAK_HEADER_SIZE 8
+#define PEAK_TABLE_SIZE  32 // Entries
+#define PEAK_SPILL_AT    (PEAK_TABLE_SIZE/2)
+
+static uint16_t gPeakFrames;          // Set by peak_set_frames(), 0 for no peak file
+static uint8_t gPeakActive;           // Recording a peak file
+static uint8_t gPeakFileOpen;
+static FIL gPeakFile;
+static char gPeakName[13];            // Peak file of the current or last recording, empty if none
+
+static uint16_t gPeakSamples;         // Samples per entry
+static uint16_t gPeakLeft;            // Samples still to go into the current entry
+static int8_t gPeakMin, gPeakMax;     // Current entry so far
+static int8_t gPeakTable[PEAK_TABLE_SIZE][2]; // Entries not yet in the file
+static uint8_t gPeakCount;            // Entries in gPeakTable
+static uint32_t gPeakSpilled;         // Entries in the file
+static uint32_t gPeakFetch;           // Next entry for peak_fetch()
+
+void peak_set_frames(uint16_t frames)
+{
+  gPeakFrames = frames;
+}
+
+static void _entry_begin(void)
+{
+  gPeakLeft = gPeakSamples;
+  gPeakMin = 127;
+  gPeakMax = -128;
+}
+
+// Create the peak file for a new recording. Returns 0 if failure, 1 if successful.
+uint8_t peak_begin(const char *fname, uint8_t channels)
+{
+  uint8_t header[PEAK_HEADER_SIZE];
+  UINT bytesWritten;
+  uint8_t i;
+
+  gPeakActive = 0;
+  gPeakName[0] = 0;
+  if (! gPeakFrames) return 1;
+
+  for (i=0; (i < 8) && fname[i] && (fname[i] != '.'); i++) gPeakName[i] = fname[i];
+  strcpy_P(gPeakName+i, PSTR(".PEK"));
+
+  if (f_open(&gPeakFile, gPeakName, FA_READ | FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+    gPeakName[0] = 0;
+    return fail(FAIL_REC, FAIL_REC_PEAKFILE);
+  }
+  gPeakFileOpen = 1;
+
+  memcpy_P(header, PSTR("PEAK"), 4);
+  *(uint16_t *)(header+4) = gPeakFrames;
+  header[6] = channels;
+  header[7] = 0;
+  if ((f_write(&gPeakFile, header, PEAK_HEADER_SIZE, &bytesWritten) != FR_OK)
+      || (bytesWritten != PEAK_HEADER_SIZE)) {
+    peak_end();
+    gPeakName[0] = 0;
+    return fail(FAIL_REC, FAIL_REC_PEAKFILE);
+  }
+
+  gPeakSamples = channels*gPeakFrames;
+  gPeakCount = 0;
+  gPeakSpilled = 0;
+  gPeakFetch = 0;
+  _entry_begin();
+  gPeakActive = 1;
+  return 1;
+}
+
+uint8_t peak_active(void)
+{
+  return gPeakActive;
+}
+
+// Add recorded samples to the overview. Should the table be full, because idle time hasn't
+// come round to spilling it, entries are lost.
+void peak_scan(const int16_t *samples, uint16_t count)
+{
+  int8_t s;
+
+  while (count--) {
+    s = *samples++ >> 8;
+    if (s < gPeakMin) gPeakMin = s;
+    if (s > gPeakMax) gPeakMax = s;
+
+    if (--gPeakLeft == 0) {
+      if (gPeakCount < PEAK_TABLE_SIZE) {
+        gPeakTable[gPeakCount][0] = gPeakMin;
+        gPeakTable[gPeakCount][1] = gPeakMax;
+        gPeakCount++;
+      }
+      _entry_begin();
+    }
+  }
+}
+
+uint8_t peak_spill_due(void)
+{
+  return gPeakActive && (gPeakCount >= PEAK_SPILL_AT);
+}
+
+// Move the table to the file
+void peak_spill(void)
+{
+  UINT bytesWritten;
+
+  if ((f_write(&gPeakFile, gPeakTable, gPeakCount*sizeof(gPeakTable[0]), &bytesWritten) != FR_OK)
+      || (bytesWritten != gPeakCount*sizeof(gPeakTable[0]))) {
+    (void) fail(FAIL_REC, FAIL_REC_PEAKFILE);
+    return;
+  }
+  gPeakSpilled += gPeakCount;
+  gPeakCount = 0;
+}
+
+// Write what is left in the table and close the file. A partial last entry is dropped.
+void peak_end(void)
+{
+  if (gPeakActive && gPeakCount) peak_spill();
+  gPeakActive = 0;
+  if (gPeakFileOpen) {
+    (void) f_close(&gPeakFile);
+    gPeakFileOpen = 0;
+  }
+}
+
+void peak_seek(uint32_t index)
+{
+  gPeakFetch = index;
+}
+
+// Copy up to 'max' entries, starting with the one set by peak_seek(), to 'buf'. Returns the
+// number of entries copied, 0 at the end of the overview, or PEAK_FETCH_NOT_READY if the
+// entry is in the file of the recording in progress.
+uint8_t peak_fetch(uint8_t *buf, uint8_t max)
+{
+  uint8_t n = 0;
+  UINT bytesRead;
+  uint32_t ix;
+
+  if (! gPeakName[0]) return 0;
+
+  // Entries that are in the file, which is only read once recording is over
+  if (gPeakFetch < gPeakSpilled) {
+    if (gPeakFileOpen) return PEAK_FETCH_NOT_READY;
+
+    n = (gPeakSpilled - gPeakFetch < max) ? (uint8_t)(gPeakSpilled - gPeakFetch) : max;
+    if (f_open(&gPeakFile, gPeakName, FA_READ | FA_OPEN_EXISTING) != FR_OK) return 0;
+
+    if ((f_lseek(&gPeakFile, PEAK_HEADER_SIZE + gPeakFetch*2) != FR_OK)
+        || (f_read(&gPeakFile, buf, n*2U, &bytesRead) != FR_OK)) {
+      bytesRead = 0;
+    }
+    n = bytesRead / 2;
+    (void) f_close(&gPeakFile);
+  }
+
+  // Entries still in the table
+  for (ix = gPeakFetch + n - gPeakSpilled; (n < max) && (ix < gPeakCount); ix++, n++) {
+    buf[n*2U] = gPeakTable[ix][0];
+    buf[n*2U+1] = gPeakTable[ix][1];
+  }
+
+  gPeakFetch += n;
+  return n;
+}
+
+#endif // WITH_PEAK
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,44 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+#ifndef _PEAK_H_
+#define _PEAK_H_
+
+#include <inttypes.h>
+
+// Entries returned by one peak_fetch() for the ')' command
+#define PEAK_FETCH_ENTRIES 63
+
+// Returned by peak_fetch() for entries that, while recording, are only in the file
+#define PEAK_FETCH_NOT_READY 0xFF
+
+extern void    peak_set_frames(uint16_t frames);
+extern uint8_t peak_begin(const char *fname, uint8_t channels);
+extern uint8_t peak_active(void);
+extern void    peak_scan(const int16_t *samples, uint16_t count);
+extern uint8_t peak_spill_due(void);
+extern void    peak_spill(void);
+extern void    peak_end(void);
+extern void    peak_seek(uint32_t index);
+extern uint8_t peak_fetch(uint8_t *buf, uint8_t max);
+
+#endif // _PEAK_H_
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -43,12 +43,40 @@
 #include "play.h"
 #include "dma.h"
 #include "i2c.h"
+#include "dac.h"
 #include "wavread.h"
+#include "timer.h"
+#include "fail.h"
 
 static uint8_t volatile gSPIInputBuffersFree;
-static uint8_t gSPIHeadBuffer;   // Which buffer is currently being filled from incoming SPI data
-static uint16_t gSPIHeadBufferIx; // Where in the buffer the next incoming SPI data packet will be stored
+static uint8_t volatile gSPIHeadBuffer; // Which buffer is currently being filled from incoming SPI data
+static uint16_t volatile gSPIHeadBufferIx; // Where in the buffer the next incoming SPI data packet will be stored
 static uint16_t gSPIFs;          // Sampling frequency to be used for SPI playback
+static uint32_t gSchedStart;     // Sample clock value at which scheduled playback begins
+static uint32_t gSchedStop;      // Sample clock value at which scheduled playback ends
+static uint8_t gPlayGain;        // Gain applied to SD playback, PLAY_GAIN_UNITY is unity gain
+static uint8_t gPlayStereo;      // Non-zero if buffers hold interleaved L/R samples
+static uint8_t gFastStart;       // Non-zero to start SD playback after the first sector instead of a full buffer
+
+// Command-to-first-sample latency of the last unscheduled SD playback, in Stopwatch() ticks
+static uint16_t gLatCommand;     // Stopwatch() when the last byte of the play command came in
+static uint16_t gLatOpen;        // From command to WAV file opened and parsed
+static uint16_t gLatRead;        // From command to first samples ready in the buffer
+static uint16_t gLatTotal;       // From command to first sample transferred to the DAC
+
+// Underrun bookkeeping. A buffer is "ready" once it has been refilled for its next turn on the DAC.
+// If DMA ping-pongs to a buffer that is not ready, the stale contents are replaced with a short
+// fade to silence rather than being replayed.
+static uint8_t volatile gBuffersReady;  // Bit 0/1 set when gBuffers[0]/[1] hold fresh samples
+static uint8_t volatile gFillBusy;      // Set while play_fill_buffer() is reading into a buffer
+static uint8_t gUnderrunning;           // Set while consecutive blocks are being concealed
+static uint16_t gUnderruns;             // Underrun events this session
+static uint16_t gConcealedBlocks;       // Blocks replaced by fade/silence this session
+static uint32_t gBlocksPlayed;          // Blocks played out this session
+
+// Number of sample frames over which a concealed block fades to silence
+#define PLAY_FADE_SHIFT   5
+#define PLAY_FADE_FRAMES  (1 << PLAY_FADE_SHIFT)
 
 /* WAV data is 16-bit signed left-adjusted, while DAC expects unsigned left-adjusted. Thus:
 
@@ -70,16 +98,125 @@ static void _transform_buffer(uint16_t *samplebuf, register uint16_t samples)
   }
 }
 
-void play_wav_file(const uint8_t *fname)
+static void _stats_reset(uint8_t stereo)
+{
+  gPlayStereo = stereo;
+  gBuffersReady = 0;
+  gFillBusy = 0;
+  gUnderrunning = 0;
+  gUnderruns = 0;
+  gConcealedBlocks = 0;
+  gBlocksPlayed = 0;
+}
+
+// Fill the rest of a buffer, starting at 16-bit word index 'ix', with a short fade from the
+// previously played frame down to mid-scale, then silence. Buffers are in DAC (unsigned) format.
+static void _conceal(uint8_t bufix, uint16_t ix)
+{
+  uint16_t *buf = (uint16_t *)gBuffers[bufix];
+  const uint16_t *prev;
+  int16_t last[2];
+  uint8_t ch, channels = gPlayStereo ? 2 : 1;
+  uint8_t step;
+
+  // The frame just before ix, which is the end of the other buffer if ix is 0
+  prev = (ix ? &buf[ix] : (const uint16_t *)&gBuffers[1-bufix][BUFFER_SIZE/2]) - channels;
+  for (ch=0; ch < channels; ch++) {
+    last[ch] = (int16_t)(prev[ch] ^ 0x8000U);
+  }
+
+  for (step=PLAY_FADE_FRAMES-1; step && (ix < BUFFER_SIZE/2); step--) {
+    for (ch=0; ch < channels; ch++) {
+      buf[ix++] = (uint16_t)(((int32_t)last[ch] * step) >> PLAY_FADE_SHIFT) ^ 0x8000U;
+    }
+  }
+  while (ix < BUFFER_SIZE/2) {
+    buf[ix++] = 0x8000U;
+  }
+}
+
+static void _count_underrun(void)
+{
+  if (! gUnderrunning) {
+    gUnderrunning = 1;
+    gUnderruns++;
+  }
+  gConcealedBlocks++;
+}
+
+// DMA has finished playing gBuffers[done] and is now playing the other buffer. It must have
+// been refilled by play_fill_buffer(). This is called from within an ISR
+static void _sd_block_done(uint8_t done)
+{
+  uint8_t next = 1 - done;
+
+  gBlocksPlayed++;
+  gBuffersReady &= ~(1 << done);
+
+  if (gBuffersReady & (1 << next)) {
+    gUnderrunning = 0;
+  } else {
+    _count_underrun();
+
+    // If the fill is still running it is about to land, and writing over it here would only
+    // make a mess. Otherwise the buffer holds what we just played a block ago.
+    if (! gFillBusy) {
+      _conceal(next, 0);
+    }
+  }
+}
+
+// DMA has finished playing gBuffers[done] and is now playing the other buffer, which must have
+// been completely received over SPI. This is called from within an ISR
+static void _spi_block_done(uint8_t done)
+{
+  uint8_t next = 1 - done;
+
+  gBlocksPlayed++;
+
+  // Free slots at this point are slots of the buffer that just started playing which the host
+  // never sent. Conceal them, and drop whatever the host was going to put there: its next
+  // packets go into the buffer that just finished, which is the one that plays next.
+  if (gSPIInputBuffersFree) {
+    _count_underrun();
+    _conceal(next, (gSPIHeadBuffer == next) ? gSPIHeadBufferIx/2 : 0);
+    gSPIHeadBuffer = done;
+    gSPIHeadBufferIx = 0;
+  } else {
+    gUnderrunning = 0;
+  }
+
+  // One whole buffer is free now
+  gSPIInputBuffersFree = (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES);
+}
+
+// Return playback underrun statistics for the current (or last) session
+void play_get_underruns(uint16_t *underruns, uint16_t *concealed, uint32_t *blocks)
+{
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    *underruns = gUnderruns;
+    *concealed = gConcealedBlocks;
+    *blocks = gBlocksPlayed;
+  }
+}
+
+static void _play_wav_file(const uint8_t *fname, uint8_t flags, uint8_t reverse)
 {
   if (! wav_open((const char *)fname)) return;
+  if (reverse && ! wav_reverse()) {
+    f_close(&gFile);
+    return;
+  }
+  gLatOpen = Stopwatch() - gLatCommand;
 
   // Don't enable yet. Do that in play_fill_buffer() below after we've filled the first 2 buffers
   gState = STATE_PLAYING_FROM_SD;
 
-  gCtrlFlags = CTRL_FLAG_KICKSTART; // Tell play_fill_buffer() handler below to fill buffers then start DMA
+  gCtrlFlags = flags; // Tell play_fill_buffer() handler below to fill buffers then start DMA
+  gPlayGain = PLAY_GAIN_UNITY;
 
   dma_begin(DMA_CFG_PLAY, (gWAVInfo.mChannels==2));
+  _stats_reset(gWAVInfo.mChannels==2);
   gActiveDMABuffer = 1; // Trust me, it's right (look at how play_fill_buffer() works on kickstarting)
   gDMABufferDone = 1;  // Trust me, it's right (look at how play_fill_buffer() works on kickstarting)
 
@@ -88,13 +225,95 @@ void play_wav_file(const uint8_t *fname)
 #endif
 }
 
+// Scale signed 16-bit samples by gain/PLAY_GAIN_UNITY, saturating
+static void _gain_buffer(int16_t *buf, register uint16_t samples, uint8_t gain)
+{
+  int32_t val;
+
+  for ( ; samples ; samples--, buf++) {
+    val = ((int32_t)*buf * gain) >> 7;
+    if (val > 32767) val = 32767;
+    else if (val < -32768) val = -32768;
+    *buf = (int16_t)val;
+  }
+}
+
+void play_set_gain(uint8_t gain)
+{
+  gPlayGain = gain;
+}
+
+// Gain and DAC format conversion for freshly-read WAV data
+static void _prepare_samples(uint8_t *buf, uint16_t bytes)
+{
+  if (gPlayGain != PLAY_GAIN_UNITY) {
+    _gain_buffer((int16_t *)buf, bytes/2, gPlayGain);
+  }
+  _transform_buffer((uint16_t *)buf, bytes/2);
+}
+
+void play_set_fast_start(uint8_t enable)
+{
+  gFastStart = enable;
+}
+
+// Remember when the play command arrived, as the reference for play_get_latency()
+void play_latency_mark(uint16_t stamp)
+{
+  gLatCommand = stamp;
+}
+
+void play_get_latency(uint16_t *open, uint16_t *read, uint16_t *total)
+{
+  *open = gLatOpen;
+  *read = gLatRead;
+  *total = gLatTotal;
+}
+
+void play_wav_file(const uint8_t *fname)
+{
+  _play_wav_file(fname, CTRL_FLAG_KICKSTART, 0);
+}
+
+// Play a WAV file backwards, from the last sample to the first
+void play_wav_file_reversed(const uint8_t *fname)
+{
+  _play_wav_file(fname, CTRL_FLAG_KICKSTART, 1);
+}
+
+// Play a WAV file with its first sample going out when the sample clock reads 'when'. The
+// buffers are filled ahead of time and DMA is enabled from the sample clock alarm ISR.
+void play_wav_file_at(const uint8_t *fname, uint32_t when)
+{
+  gSchedStart = when;
+  _play_wav_file(fname, CTRL_FLAG_KICKSTART | CTRL_FLAG_SCHEDULED, 0);
+}
+
+// End SD playback so that the sample at sample clock value 'when' is silent.
+void play_stop_at(uint32_t when)
+{
+  if (gState != STATE_PLAYING_FROM_SD) return;
+
+  // Stage 1 happens one sample early: stop DMA so that no samples past when-1 are transferred.
+  gSchedStop = when;
+  if (! rateclock_alarm(RATECLOCK_ALARM_STOP, when-1)) {
+    gCtrlFlags |= CTRL_FLAG_STOPPED;
+  }
+}
+
 void play_from_SPI(uint16_t Fs, uint8_t stereo)
 {
+  if (Fs < RATECLOCK_MIN_FS) {
+    (void) fail(FAIL_RATE, FAIL_RATE_CLOCK);
+    return;
+  }
+
   gState = STATE_PLAYING_FROM_SPI;
   gCtrlFlags = CTRL_FLAG_KICKSTART; // Tell play_SPI_buffer() handler below to start DMA when data is received
   gSPIFs = Fs;
 
   dma_begin(DMA_CFG_PLAY, stereo);
+  _stats_reset(stereo);
   gActiveDMABuffer = 0;
   gDMABufferDone = 0;
 
@@ -115,12 +334,16 @@ uint8_t play_SPI_get_free_buffers(void)
 void play_SPI_add_buffer(const uint8_t *buf)
 {
   uint8_t *dst;
+  uint8_t head;
+  uint16_t headIx;
 
   if (gSPIInputBuffersFree) {
     ATOMIC_BLOCK(ATOMIC_FORCEON) {
       gSPIInputBuffersFree--;
+      head = gSPIHeadBuffer;
+      headIx = gSPIHeadBufferIx;
     }
-    dst = (uint8_t *)(gBuffers[gSPIHeadBuffer]) + gSPIHeadBufferIx;
+    dst = (uint8_t *)(gBuffers[head]) + headIx;
 #if 0
     memcpy(dst, buf, SPI_STREAM_SIZE_BYTES);
     _transform_buffer((uint16_t *)dst, SPI_STREAM_SIZE_BYTES/2);
@@ -136,20 +359,25 @@ void play_SPI_add_buffer(const uint8_t *buf)
     }
 #endif
 
-    gSPIHeadBufferIx += SPI_STREAM_SIZE_BYTES;
-    if (gSPIHeadBufferIx >= BUFFER_SIZE) {
-      gSPIHeadBufferIx = 0;
-      gSPIHeadBuffer = 1 - gSPIHeadBuffer;
-      
-      // Start actual playback when the whole first buffer (1024 bytes) is filled
-      if (gCtrlFlags & CTRL_FLAG_KICKSTART) {
-        rateclock_start(gSPIFs); // DMA transfers will start shortly, triggered by Event Channel 0
-
-        // Enable Channel 0. Let double-buffering action enable buffer 1 after first block of channel 0 is done.
-        DMA.CH0.CTRLA |= DMA_ENABLE_bm;
-        gCtrlFlags &= ~CTRL_FLAG_KICKSTART;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      // If an underrun was concealed while we were copying, the head has moved on and this packet is dropped
+      if ((head == gSPIHeadBuffer) && (headIx == gSPIHeadBufferIx)) {
+        gSPIHeadBufferIx += SPI_STREAM_SIZE_BYTES;
+        if (gSPIHeadBufferIx >= BUFFER_SIZE) {
+          gSPIHeadBufferIx = 0;
+          gSPIHeadBuffer = 1 - gSPIHeadBuffer;
+        }
       }
     }
+
+    // Start actual playback when the whole first buffer (1024 bytes) is filled
+    if ((gCtrlFlags & CTRL_FLAG_KICKSTART) && (gSPIHeadBuffer == 1)) {
+      (void) rateclock_start(gSPIFs); // DMA transfers will start shortly, triggered by Event Channel 0
+
+      // Enable Channel 0. Let double-buffering action enable buffer 1 after first block of channel 0 is done.
+      DMA.CH0.CTRLA |= DMA_ENABLE_bm;
+      gCtrlFlags &= ~CTRL_FLAG_KICKSTART;
+    }
   } // else, we drop this buffer
 }
 
@@ -173,15 +401,14 @@ void play_dma_ch0_isr(void)
       } else if (gCtrlFlags & CTRL_FLAG_BUFFER1_IS_LAST) {
         // Fill this buffer with silence so that once the other one ping-pongs back to us, we play silence
         buffers_clear(0);
+      } else {
+        _sd_block_done(0);
       }
       break;
 
     case STATE_PLAYING_FROM_SPI:
       // If we finished playing a buffer, one more SPI buffer is free
-      gSPIInputBuffersFree += (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES);
-      if (gSPIInputBuffersFree > (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES)*2) {
-        gSPIInputBuffersFree = (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES)*2;
-      }
+      _spi_block_done(0);
       break;
 
     default:
@@ -201,15 +428,14 @@ void play_dma_ch1_isr(void)
       } else if (gCtrlFlags & CTRL_FLAG_BUFFER0_IS_LAST) {
         // Fill this buffer with 0's so that once the other one ping-pongs back to us, we play silence
         buffers_clear(1);
+      } else {
+        _sd_block_done(1);
       }
       break;
 
     case STATE_PLAYING_FROM_SPI:
       // If we finished playing a buffer, one more SPI buffer is free
-      gSPIInputBuffersFree += (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES);
-      if (gSPIInputBuffersFree > (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES)*2) {
-        gSPIInputBuffersFree = (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES)*2;
-      }
+      _spi_block_done(1);
       break;
 
     default:
@@ -217,6 +443,30 @@ void play_dma_ch1_isr(void)
   }
 }
 
+// Called from rateclock.c when the sample clock reaches the scheduled start time.
+// This is called from within an ISR
+void play_sched_start_isr(void)
+{
+  if (gState == STATE_PLAYING_FROM_SD) {
+    // Buffers were filled and TCC0 is running, so the very next event transfers the first sample
+    DMA.CH0.CTRLA |= DMA_ENABLE_bm;
+  }
+}
+
+// Called from rateclock.c when the sample clock reaches the scheduled stop time (minus 1, then
+// again at the stop time itself). This is called from within an ISR
+void play_sched_stop_isr(void)
+{
+  if (DMA.CTRL & DMA_ENABLE_bm) {
+    dma_off(); // Finishes the burst in progress, then no more samples
+    if (rateclock_alarm(RATECLOCK_ALARM_STOP, gSchedStop)) return;
+  }
+
+  // The last sample has been held for one sample period. Now go quiet.
+  dac_silence();
+  gCtrlFlags |= CTRL_FLAG_STOPPED;
+}
+
 void play_stop(void)
 {
   _dma_off();
@@ -232,8 +482,82 @@ void play_stop(void)
   gState = STATE_IDLE;
 }
 
+// Buffer 0 holds the first samples: start the sample rate clock and DMA
+static void _kickstart(void)
+{
+  uint16_t now;
+  uint16_t clocks;
+
+  gLatRead = Stopwatch() - gLatCommand;
+
+  (void) rateclock_start(gWAVInfo.mSamplingRate); // DMA transfers will start shortly, triggered by Event Channel 0
+
+  // Enable Channel 0. Let double-buffering action enable buffer 1 after first block of channel 0 is done.
+  // Scheduled playback leaves that to the alarm ISR, which is armed one sample early so that
+  // the first transfer happens on the event that makes the sample clock read gSchedStart.
+  if (! (gCtrlFlags & CTRL_FLAG_SCHEDULED) || ! rateclock_alarm(RATECLOCK_ALARM_START, gSchedStart-1)) {
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      DMA.CH0.CTRLA |= DMA_ENABLE_bm;
+
+      // The first transfer happens on the next TCC0 overflow
+      now = Stopwatch();
+      clocks = TCC0.PER - TCC0.CNT;
+    }
+    gLatTotal = now + clocks/STOPWATCH_CLOCKS_PER_TICK - gLatCommand;
+  }
+
+  // Fill the other buffer next
+  gDMABufferDone = 1;
+  gActiveDMABuffer = 0;
+  gCtrlFlags &= ~CTRL_FLAG_KICKSTART;
+}
+
+// Fast start: read only up to a sector boundary into buffer 0 (see wav_first_sector_bytes()),
+// start DMA on that, then read the rest of buffer 0 while the first samples play.
+static void _fast_start(UINT first)
+{
+  uint8_t *buf = (uint8_t *)gBuffers[0];
+  UINT bytesRead;
+
+  gDMABufferDone = 0;
+  gFillBusy = 1;
+  if (! wav_read(buf, first, &bytesRead)) {
+    play_stop();
+    return;
+  }
+  _prepare_samples(buf, first);
+
+  _kickstart();
+
+  // wav_first_sector_bytes() guaranteed there's more than a buffer's worth in the file
+  if (! wav_read(buf+first, BUFFER_SIZE-first, &bytesRead)) {
+    play_stop();
+    return;
+  }
+  _prepare_samples(buf+first, BUFFER_SIZE-first);
+
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    gBuffersReady |= 1;
+    gFillBusy = 0;
+  }
+}
+
 void play_fill_buffer(void)
 {
+  if (gCtrlFlags & CTRL_FLAG_STOPPED) {
+    play_stop();
+    return;
+  }
+
+  if (gFastStart && ((gCtrlFlags & (CTRL_FLAG_KICKSTART|CTRL_FLAG_SCHEDULED)) == CTRL_FLAG_KICKSTART)) {
+    UINT first = wav_first_sector_bytes();
+
+    if (first) {
+      _fast_start(first);
+      return;
+    }
+  }
+
   if (gDMABufferDone) {
     UINT bytesRead;
     uint8_t readBufIx = 1 - gActiveDMABuffer; // Which buffer we are going to fill from SD card data
@@ -252,12 +576,13 @@ void play_fill_buffer(void)
 
     gDMABufferDone = 0;
 
+    gFillBusy = 1;
     if (! wav_fill_buffer((uint16_t *)(gBuffers[readBufIx]), &bytesRead)) {
       play_stop();
       return;
     }
 
-    _transform_buffer((uint16_t *)gBuffers[readBufIx], BUFFER_SIZE/2);
+    _prepare_samples((uint8_t *)gBuffers[readBufIx], BUFFER_SIZE);
 
     // Is this the last buffer? If so, fill it with 0's and set a flag indicating
     // that on the next ping-pong, we should quit.
@@ -271,16 +596,14 @@ void play_fill_buffer(void)
       gCtrlFlags = (1 << (readBufIx));
     }
 
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      gBuffersReady |= (1 << readBufIx);
+      gFillBusy = 0;
+    }
+
     // Are we waiting to kickstart the playback?
     if (gCtrlFlags & CTRL_FLAG_KICKSTART) {
-      rateclock_start(gWAVInfo.mSamplingRate); // DMA transfers will start shortly, triggered by Event Channel 0
-      // Enable Channel 0. Let double-buffering action enable buffer 1 after first block of channel 0 is done.
-      DMA.CH0.CTRLA |= DMA_ENABLE_bm;
-
-      // Fill the other buffer now too
-      gDMABufferDone = 1;
-      gActiveDMABuffer = 0;
-      gCtrlFlags &= ~CTRL_FLAG_KICKSTART;
+      _kickstart();
     }
   }
 }
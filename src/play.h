@@ -24,13 +24,25 @@
 
 #include "ff.h"
 
+#define PLAY_GAIN_UNITY 128
+
 extern void    play_wav_file(const uint8_t *fname);
+extern void    play_wav_file_reversed(const uint8_t *fname);
+extern void    play_wav_file_at(const uint8_t *fname, uint32_t when);
+extern void    play_stop_at(uint32_t when);
+extern void    play_set_gain(uint8_t gain);
+extern void    play_set_fast_start(uint8_t enable);
+extern void    play_latency_mark(uint16_t stamp);
+extern void    play_get_latency(uint16_t *open, uint16_t *read, uint16_t *total);
+extern void    play_get_underruns(uint16_t *underruns, uint16_t *concealed, uint32_t *blocks);
 extern void    play_from_SPI(uint16_t Fs, uint8_t stereo);
 extern uint8_t play_SPI_get_free_buffers(void);
 extern void    play_SPI_add_buffer(const uint8_t *buf);
 extern void    play_stop(void);
 extern void    play_dma_ch0_isr(void);
 extern void    play_dma_ch1_isr(void);
+extern void    play_sched_start_isr(void);
+extern void    play_sched_stop_isr(void);
 extern void    play_fill_buffer(void);
 
 #endif // _PLAY_H_
@@ -20,27 +20,175 @@
   <http://www.gnu.org/licenses>
 */
 /*
- * This configures TCC0 to generate Event Channel 0 at the user-selected sampling rate
+ * This configures TCC0 to generate Event Channel 0 at the user-selected sampling rate.
+ *
+ * TCC1 is clocked from Event Channel 0 so it counts every sample period in hardware. Together
+ * with a 16-bit overflow count kept in software this forms a 32-bit sample clock. The two
+ * TCC1 compare channels serve as alarms that fire at an absolute sample clock value, for
+ * starting and stopping playback at exactly the requested sample.
  */
 
 #include <stddef.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "config.h"
+#include "fail.h"
+#include "play.h"
 #include "rateclock.h"
 
-void rateclock_start(uint16_t Fs)
+static volatile uint16_t gSampleClockHigh; // Upper 16 bits of the sample clock, TCC1 has the lower 16 bits
+static uint16_t gAlarmHigh[RATECLOCK_NUM_ALARMS]; // Upper 16 bits of the sample clock at which each alarm fires
+static uint16_t gTimebaseFs; // Non-zero when the sample clock is free-running as a timebase between activities
+
+static void _set_period(uint16_t Fs)
+{
+  TCC0.PERBUF = (32000000UL / Fs)-1; // 32 MHz / 16 kHz --> 2000. Buffered so a running clock changes cleanly.
+}
+
+static void _start(uint16_t Fs)
 {
+  TCC0.CTRLA = 0;
+  TCC1.CTRLA = 0;
+
+  // Sample clock starts from 0. TCC1 counts Event Channel 0, i.e., every TCC0 overflow.
+  TCC1.CTRLB = TC_WGMODE_NORMAL_gc; // No CCxEN bits...PC4/PC5 belong to the SPI slave interface
+  TCC1.PER = 0xFFFF;
+  TCC1.CNT = 0;
+  gSampleClockHigh = 0;
+  TCC1.INTFLAGS = TC1_OVFIF_bm | TC1_CCAIF_bm | TC1_CCBIF_bm;
+  TCC1.INTCTRLA = TC_OVFINTLVL_HI_gc;
+  TCC1.INTCTRLB = 0;
+  TCC1.CTRLA = TC_CLKSEL_EVCH0_gc;
+
   TCC0.CTRLB = TC_WGMODE_NORMAL_gc;
   TCC0.PER = (32000000UL / Fs)-1; // 32 MHz / 16 kHz --> 2000
+  TCC0.CNT = 0;
   TCC0.INTFLAGS = TC0_OVFIF_bm; // Clear timer overflow flag
-  TCC0.CTRLA = TC_CLKSEL_DIV1_gc; // Divide by 1, so 32 MHz clock (31.25ns period)
 
   // Configure event system to route TCC0 overflow to Event Channel 0
   EVSYS.CH0MUX = EVSYS_CHMUX_TCC0_OVF_gc;
+
+  TCC0.CTRLA = TC_CLKSEL_DIV1_gc; // Divide by 1, so 32 MHz clock (31.25ns period)
+}
+
+// Returns 0 (and sets a fail code) if the rate clock cannot make Fs, see RATECLOCK_MIN_FS
+uint8_t rateclock_start(uint16_t Fs)
+{
+  if (Fs < RATECLOCK_MIN_FS) return fail(FAIL_RATE, FAIL_RATE_CLOCK);
+
+  // A free-running timebase keeps counting. Only the sampling rate is changed if necessary.
+  if (gTimebaseFs) {
+    _set_period(Fs);
+  } else {
+    _start(Fs);
+  }
+  return 1;
 }
 
 void rateclock_stop(void)
 {
-  TCC0.CTRLA = 0;
+  rateclock_alarm_cancel(RATECLOCK_ALARM_START);
+  rateclock_alarm_cancel(RATECLOCK_ALARM_STOP);
+
+  if (gTimebaseFs) {
+    _set_period(gTimebaseFs);
+  } else {
+    TCC0.CTRLA = 0;
+    TCC1.CTRLA = 0;
+    TCC1.INTCTRLA = 0;
+  }
+}
+
+// Start (Fs non-zero) or stop (Fs zero) a free-running sample clock, independent of any activity.
+// Starting resets the sample clock to 0. Subsequent activities at a different sampling rate
+// change the rate but not the count. Returns 0 (and sets a fail code, leaving any timebase
+// running) if the rate clock cannot make Fs.
+uint8_t rateclock_timebase(uint16_t Fs)
+{
+  if (Fs && (Fs < RATECLOCK_MIN_FS)) return fail(FAIL_RATE, FAIL_RATE_CLOCK);
+
+  gTimebaseFs = 0;
+  if (Fs) {
+    _start(Fs);
+    gTimebaseFs = Fs;
+  } else {
+    rateclock_stop();
+  }
+  return 1;
+}
+
+// Return the sampling rate of the free-running timebase, or 0 if there is none
+uint16_t rateclock_timebase_rate(void)
+{
+  return gTimebaseFs;
+}
+
+// Return the number of sample periods since the sample clock was started
+uint32_t rateclock_samples(void)
+{
+  uint16_t hi, lo;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    hi = gSampleClockHigh;
+    lo = TCC1.CNT;
+
+    // Overflow happened but the ISR has not run yet (we have interrupts off)
+    if ((TCC1.INTFLAGS & TC1_OVFIF_bm) && !(lo & 0x8000U)) hi++;
+  }
+  return ((uint32_t)hi << 16) | lo;
+}
+
+// Arm an alarm that fires when the sample clock reaches the given value. Returns 0 (and does not
+// arm) if that time has already come, in which case the caller should act immediately.
+// May be called from an ISR.
+uint8_t rateclock_alarm(RateclockAlarm_t which, uint32_t when)
+{
+  uint8_t armed = 0;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if ((int32_t)(when - rateclock_samples()) > 0) {
+      gAlarmHigh[which] = (uint16_t)(when >> 16);
+      if (which == RATECLOCK_ALARM_START) {
+        TCC1.CCA = (uint16_t)when;
+        TCC1.INTFLAGS = TC1_CCAIF_bm;
+        TCC1.INTCTRLB = (TCC1.INTCTRLB & ~TC1_CCAINTLVL_gm) | TC_CCAINTLVL_HI_gc;
+      } else {
+        TCC1.CCB = (uint16_t)when;
+        TCC1.INTFLAGS = TC1_CCBIF_bm;
+        TCC1.INTCTRLB = (TCC1.INTCTRLB & ~TC1_CCBINTLVL_gm) | TC_CCBINTLVL_HI_gc;
+      }
+      armed = 1;
+    }
+  }
+  return armed;
+}
+
+void rateclock_alarm_cancel(RateclockAlarm_t which)
+{
+  TCC1.INTCTRLB &= (which == RATECLOCK_ALARM_START) ? ~TC1_CCAINTLVL_gm : ~TC1_CCBINTLVL_gm;
+}
+
+// The OVF vector has priority over the CCx vectors, so when the compare value is 0 the upper
+// half of the sample clock has already been incremented by the time the compare ISR runs.
+ISR(TCC1_OVF_vect)
+{
+  gSampleClockHigh++;
+}
+
+ISR(TCC1_CCA_vect)
+{
+  if (gSampleClockHigh == gAlarmHigh[RATECLOCK_ALARM_START]) {
+    rateclock_alarm_cancel(RATECLOCK_ALARM_START);
+    play_sched_start_isr();
+  }
+}
+
+ISR(TCC1_CCB_vect)
+{
+  if (gSampleClockHigh == gAlarmHigh[RATECLOCK_ALARM_STOP]) {
+    rateclock_alarm_cancel(RATECLOCK_ALARM_STOP);
+    play_sched_stop_isr();
+  }
 }
 // vim: expandtab ts=2 sw=2 ai cindent
@@ -23,9 +23,25 @@
 #define _RATECLOCK_H_
 
 #include <inttypes.h>
+#include "adcplan.h"
 
-extern void rateclock_start(uint16_t Fs);
-extern void rateclock_stop(void);
+// Lowest sampling rate: TCC0 counts 32 MHz clocks, and the period must fit in 16 bits
+#define RATECLOCK_MIN_FS  ADCPLAN_MIN_FS
+
+typedef enum {
+  RATECLOCK_ALARM_START,  // TCC1 CCA: start playback at a sample time
+  RATECLOCK_ALARM_STOP,   // TCC1 CCB: stop playback at a sample time
+
+  RATECLOCK_NUM_ALARMS
+} RateclockAlarm_t;
+
+extern uint8_t  rateclock_start(uint16_t Fs);
+extern void     rateclock_stop(void);
+extern uint8_t  rateclock_timebase(uint16_t Fs);
+extern uint16_t rateclock_timebase_rate(void);
+extern uint32_t rateclock_samples(void);
+extern uint8_t  rateclock_alarm(RateclockAlarm_t which, uint32_t when);
+extern void     rateclock_alarm_cancel(RateclockAlarm_t which);
 
 #endif // _RATECLOCK_H_
 // vim: expandtab ts=2 sw=2 ai cindent
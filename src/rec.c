@@ -25,6 +25,7 @@
  */
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 #include <inttypes.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
@@ -42,13 +43,268 @@
 #include "rateclock.h"
 #include "fail.h"
 #include "rec.h"
+#include "adpcm.h"
+#include "pack12.h"
+#include "cue.h"
+#include "peak.h"
+#include "dcblock.h"
+#include "agc.h"
+#include "decim.h"
+#include "timer.h"
+#include "sdlat.h"
 
 static uint8_t volatile gSPIOutputBuffersFull;
 static uint8_t gSPITailBuffer;   // Which buffer is currently being emptied by outgoing SPI data
-static uint8_t gSPITailBufferIx; // Where in the buffer the next outgoing SPI data packet will be retrieved
+static uint16_t gSPITailBufferIx; // Where in the buffer the next outgoing SPI data packet will be retrieved
+
+// Sample position, for cue markers
+static uint32_t volatile gRecBlocks; // DMA blocks completed since recording started
+static uint16_t gRecFs;
+static uint8_t gRecFrameShift;       // log2 of bytes per sample frame
+
+// Recording to SD normally writes each 512-byte sector as soon as DMA has filled it, rather than
+// waiting for a whole buffer. That keeps each main loop stall to a single sector write.
+#define REC_SECTOR_SIZE 512
+#define REC_SECTORS     (2*BUFFER_SIZE/REC_SECTOR_SIZE) // Sectors in both ping-pong buffers
+static uint8_t gRecSectorFlush = 1; // Zero to flush whole buffers instead
+static uint8_t gRecNextSector;      // Next sector of gBuffers[] to be written
+static uint8_t gRecScanSector;      // Next sector of gBuffers[] to be processed by _rec_process()
+
+// Decimation, for oversampling or for storing/streaming at a lower rate than is captured: the ADC
+// runs 2^gRecDecimShift times faster than the file's or stream's sampling rate. For SD, each
+// sector is decimated in place, leaving gRecSectorBytes of audio at its start to be written.
+// Only PCM recordings are decimated, and always a sector at a time. For SPI, each DMA buffer is
+// decimated in place by rec_SPI_process_buffer().
+#if WITH_DECIM==1
+// Samples per second the decimator takes in at most, all channels together, for decimation by
+// 2, 4 and 8. Each output sample costs an estimated 514, 830 and 966 cycles (CIC plus halfband,
+// see decimsim.py), and the decimator is allowed half of the 32 MHz CPU, leaving the rest for
+// SD writes and SPI: 16e6*M/cycles. For example, 22.05 kHz stereo decimated by 2 would take 71%
+// and is refused, 22.05 kHz mono decimated by 2 takes 35%.
+static const uint32_t gRecDecimMaxInput[DECIM_MAX_SHIFT] PROGMEM = { 62256UL, 77108UL, 132505UL };
+static uint8_t gRecOversample;      // Largest oversampling factor allowed, 0 or 1 for none
+#endif
+static uint8_t gRecDecimShift;
+static uint16_t gRecSectorBytes = REC_SECTOR_SIZE;
+
+// Encoding of SD recordings. Anything but PCM works on whole buffers.
+static WavCodec_t gRecCodec;
+static WavCodec_t gRecWriteCodec;   // Encoding of the recording in progress, gRecCodec until it degrades
+
+// Graceful degradation: once REC_DEGRADE_LAG sectors filled by DMA are waiting to be written, a
+// PCM SD recording carries on in gRecDegradeCodec in a second file (see wav_degrade()). Sector
+// flushes go on to the end of the buffer first, then whole buffers are encoded and written.
+// Not with VOX, whose gap log counts PCM sectors, nor decimation, which only works on sectors.
+#define REC_DEGRADE_LAG 3
+static uint8_t gRecDegradeCodec;    // WavCodec_t to fall back to, WAV_CODEC_PCM for none
+static uint8_t gRecDegradePending;  // Switch at the next buffer boundary
+
+#if WITH_VOX==1
+// Voice-activated recording: the ADC runs all the time but audio is only written to the file
+// while its peak level is at or above the threshold, and for a hang time after that. Quiet
+// sectors leading up to the trigger are still in the ping-pong buffers and are written too as
+// pre-roll, so pre-roll is limited to what the buffers hold. That is all the RAM there is.
+#define VOX_MAX_PREROLL (REC_SECTORS-2) // Leaves one sector for DMA and one for the write in progress
+static uint16_t gVoxThreshold;      // 0 disables VOX
+static uint16_t gVoxHangMs = 1000;
+static uint16_t gVoxPrerollMs = 50;
+static uint16_t gVoxHangSectors;    // gVoxHangMs for the current recording
+static uint8_t gVoxPreroll;         // gVoxPrerollMs for the current recording
+static uint16_t gVoxHang;           // Sectors left before the gate closes, 0 when closed
+static uint8_t gVoxToWrite;         // Sectors from gRecNextSector on that are to be written
+static uint8_t gVoxPending;         // Quiet sectors from gRecNextSector on kept as pre-roll
+
+// Gap logging: for a continuous timeline, every stretch of audio that VOX drops is logged to a
+// sidecar file with the recording's name and a .GAP extension. Each gap is a pair of 32-bit
+// little-endian values: sample frames in the WAV file before the gap, and frames dropped.
+// gapexpand.py puts the silence back on the host.
+#define VOX_GAP_ENTRIES 8
+static uint8_t gVoxGapsRequested;   // Set by rec_set_vox_gaps()
+static uint8_t gVoxGaps;            // Gap logging is active for the current recording
+static FIL gGapFile;
+static uint32_t gGapTable[VOX_GAP_ENTRIES][2]; // Gaps not yet written to gGapFile
+static uint8_t gGapCount;
+static uint16_t gGapFramesPerSector;
+static uint32_t gGapSectorsKept;    // Sectors written to the WAV file so far
+static uint32_t gGapSectorsDropped; // Sectors dropped since then
+
+// Convert a time to a number of sectors of 16-bit samples, rounding up
+static uint16_t _vox_sectors(uint16_t ms, uint16_t Fs, uint8_t channels)
+{
+  uint32_t bytesPerMs = ((uint32_t)Fs * channels*2 + 999) / 1000;
+
+  return ((uint32_t)ms * bytesPerMs + REC_SECTOR_SIZE-1) / REC_SECTOR_SIZE;
+}
+
+static uint8_t _vox_begin(uint16_t Fs, uint8_t channels, const uint8_t *fname)
+{
+  uint16_t preroll = _vox_sectors(gVoxPrerollMs, Fs, channels);
+
+  gVoxPreroll = (preroll > VOX_MAX_PREROLL) ? VOX_MAX_PREROLL : preroll;
+  gVoxHangSectors = _vox_sectors(gVoxHangMs, Fs, channels);
+  gVoxHang = 0;
+  gVoxToWrite = 0;
+  gVoxPending = 0;
+
+  gVoxGaps = gVoxThreshold && gVoxGapsRequested;
+  gGapCount = 0;
+  gGapFramesPerSector = gRecSectorBytes / (channels*2);
+  gGapSectorsKept = 0;
+  gGapSectorsDropped = 0;
+  if (gVoxGaps) {
+    char name[13];
+    uint8_t i;
+
+    for (i=0; (i < 8) && fname[i] && (fname[i] != '.'); i++) name[i] = fname[i];
+    strcpy_P(name+i, PSTR(".GAP"));
+    if (f_open(&gGapFile, name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+      gVoxGaps = 0;
+      return fail(FAIL_REC, FAIL_REC_GAPFILE);
+    }
+  }
+  return 1;
+}
+
+static uint8_t _gap_flush(void)
+{
+  FRESULT fresult;
+  UINT bytesWritten;
+
+  if (gGapCount) {
+    sdlat_begin();
+    fresult = f_write(&gGapFile, gGapTable, gGapCount*sizeof(gGapTable[0]), &bytesWritten);
+    sdlat_end();
+    if ((fresult != FR_OK) || (bytesWritten < gGapCount*sizeof(gGapTable[0]))) {
+      return fail(FAIL_REC, FAIL_REC_GAPFILE);
+    }
+    gGapCount = 0;
+  }
+  return 1;
+}
+
+// Close off the gap in progress, if any
+static uint8_t _gap_log(void)
+{
+  if (! gGapSectorsDropped) return 1;
+
+  gGapTable[gGapCount][0] = gGapSectorsKept * gGapFramesPerSector;
+  gGapTable[gGapCount][1] = gGapSectorsDropped * gGapFramesPerSector;
+  gGapSectorsDropped = 0;
+  if (++gGapCount == VOX_GAP_ENTRIES) return _gap_flush();
+  return 1;
+}
+
+// Account for sectors about to be written to the WAV file. Returns 0 if the gap file fails.
+static uint8_t _vox_kept(uint8_t sectors)
+{
+  if (gVoxGaps && ! _gap_log()) return 0;
+  gGapSectorsKept += sectors;
+  return 1;
+}
+
+static void _vox_end(void)
+{
+  if (gVoxGaps) {
+    (void) (_gap_log() && _gap_flush());
+    f_close(&gGapFile);
+    gVoxGaps = 0;
+  }
+}
+
+// Update the gate with a block of samples. Returns 1 if the block is to be written.
+static uint8_t _vox_gate(const uint8_t *buf, uint16_t bytes)
+{
+  const int16_t *p = (const int16_t *)buf;
+  uint16_t count, mag;
+  uint8_t sectors = bytes/gRecSectorBytes;
+
+  for (count = bytes/2; count; count--) {
+    mag = (*p < 0) ? -(uint16_t)*p : *p;
+    p++;
+    if (mag >= gVoxThreshold) {
+      gVoxHang = gVoxHangSectors;
+      return 1;
+    }
+  }
+
+  if (gVoxHang) {
+    gVoxHang = (gVoxHang > sectors) ? gVoxHang-sectors : 0;
+    return 1;
+  }
+  return 0;
+}
+
+// Decide what happens to the next sector DMA has finished, which follows any pre-roll sectors
+static void _vox_decide(uint8_t sector)
+{
+  if (_vox_gate((const uint8_t *)gBuffers + sector*REC_SECTOR_SIZE, gRecSectorBytes)) {
+    gVoxToWrite = gVoxPending+1;
+    gVoxPending = 0;
+  } else if (gVoxPending < gVoxPreroll) {
+    gVoxPending++;
+  } else {
+    // Oldest pre-roll sector drops out
+    if (++gRecNextSector == REC_SECTORS) gRecNextSector = 0;
+    gGapSectorsDropped++;
+  }
+}
+
+void rec_set_vox_threshold(uint16_t level)
+{
+  gVoxThreshold = level;
+}
+
+void rec_set_vox_hang(uint16_t ms)
+{
+  gVoxHangMs = ms;
+}
+
+void rec_set_vox_preroll(uint16_t ms)
+{
+  gVoxPrerollMs = ms;
+}
+
+void rec_set_vox_gaps(uint8_t enable)
+{
+  gVoxGapsRequested = enable;
+}
+#endif // WITH_VOX
+
+// Channels for the 'stereo' byte of 'R' and 'I'
+static uint8_t _rec_channels(uint8_t stereo)
+{
+  return (stereo == REC_STEREO_QUAD) ? 4 : (stereo ? 2 : 1);
+}
+
+// ADC channels swept for the channels recorded, and for the mic or the line in
+static RecType_t _rec_type(uint8_t channels, uint8_t source)
+{
+  if (channels == 4) return REC_QUAD;
+  return (source & REC_SOURCE_MIC) ? REC_MIC : REC_LINE;
+}
+
+// Four channels are only recorded as PCM, without decimation, at up to REC_QUAD_MAX_FS
+static uint8_t _rec_quad_ok(uint16_t Fs, uint8_t source, uint8_t pcm)
+{
+  if ((Fs > REC_QUAD_MAX_FS) || (source & REC_SOURCE_DECIM_MASK) || ! pcm) return fail(FAIL_REC, FAIL_REC_RATE);
+  return 1;
+}
 
 static void _rec_common(uint16_t Fs, uint8_t stereo, uint8_t source)
 {
+  uint8_t channels = _rec_channels(stereo);
+  RecType_t type = _rec_type(channels, source);
+
+  gRecBlocks = 0;
+  gRecFs = Fs;
+  gRecFrameShift = (channels == 4) ? 3 : channels;
+#if WITH_DECIM==1
+  decim_begin(gRecDecimShift, channels > 1);
+#endif
+#if WITH_DCBLOCK==1
+  dcblock_begin(channels);
+#endif
+
   dma_begin(DMA_CFG_RECORD, stereo);
   gActiveDMABuffer = 0;
   gDMABufferDone = 0;
@@ -57,25 +313,119 @@ static void _rec_common(uint16_t Fs, uint8_t stereo, uint8_t source)
   // DMA trigger will be A/D conversion complete.
   DMA.CH0.CTRLA |= DMA_ENABLE_bm;
 
-  // ADC conversion complete will trigger DMA action
-  adc_start(source ? REC_MIC : REC_LINE); 
+  // ADC conversion complete will trigger DMA action. The rate was checked by the caller.
+  (void) adc_start(type, Fs << gRecDecimShift);
+#if WITH_AGC==1
+  agc_begin(Fs, channels, type, gState == STATE_RECORDING_TO_SPI);
+#endif
 
   // TCC0 events will trigger A/D sampling
-  rateclock_start(Fs);
+  (void) rateclock_start(Fs << gRecDecimShift);
+}
+
+#if WITH_DECIM==1
+// Whether the ADC can run 2^shift times faster than Fs: within what adcplan.h allows and
+// gRecDecimMaxInput[]. Four channels are never decimated so the ADC sweeps 2.
+static uint8_t _rec_decim_fits(uint16_t Fs, uint8_t channels, uint8_t shift)
+{
+  uint32_t rate = (uint32_t)Fs << shift;
+
+  return (rate <= adc_max_rate(REC_LINE)) && (rate*channels <= pgm_read_dword(&gRecDecimMaxInput[shift-1]));
+}
+
+// Pick the decimation for an SD recording: the factor in 'source' if there is one, otherwise
+// the largest oversampling factor allowed that fits. Decimated sectors are written in part,
+// which only PCM recording does and raw mode cannot. Returns 0 (and sets a fail code) if the
+// factor asked for cannot be used. Four channels are never decimated.
+static uint8_t _rec_decim_begin(uint16_t Fs, uint8_t channels, uint8_t source)
+{
+  uint8_t shift = (source & REC_SOURCE_DECIM_MASK) >> REC_SOURCE_DECIM_SHIFT;
+  uint8_t partial = (gRecCodec == WAV_CODEC_PCM) && ! wav_raw_requested();
+
+  if (shift) {
+    if (! partial || ! _rec_decim_fits(Fs, channels, shift)) return fail(FAIL_REC, FAIL_REC_RATE);
+  } else if (partial && (channels <= 2)) {
+    while ((shift < DECIM_MAX_SHIFT) && ((2U << shift) <= gRecOversample) && _rec_decim_fits(Fs, channels, shift+1)) {
+      shift++;
+    }
+  }
+
+  gRecDecimShift = shift;
+  gRecSectorBytes = REC_SECTOR_SIZE >> shift;
+  return 1;
 }
+#endif
 
-// Source is 0 for line in, 1 for mic.
+// See REC_SOURCE_xxx for 'source'. Fs is the file's sampling rate.
 void record_wav_file(uint8_t source, uint16_t Fs, uint8_t stereo, const uint8_t *fname)
 {
-  if (! wav_create((const char *)fname, stereo, Fs)) return;
+  uint8_t channels = _rec_channels(stereo);
+  uint8_t degrade;
+
+  if ((channels == 4) && ! _rec_quad_ok(Fs, source, gRecCodec == WAV_CODEC_PCM)) return;
+#if WITH_DECIM==1
+  if (! _rec_decim_begin(Fs, channels, source)) return;
+#endif
+  if (! adc_rate_ok(Fs << gRecDecimShift, _rec_type(channels, source))) return;
+#if WITH_VOX==1
+  if (! _vox_begin(Fs << gRecDecimShift, channels, fname)) return;
+#endif
+#if WITH_PEAK==1
+  if (! peak_begin((const char *)fname, channels)) {
+#if WITH_VOX==1
+    _vox_end();
+#endif
+    return;
+  }
+#endif
+  if (! wav_create((const char *)fname, channels, Fs, gRecCodec)) {
+#if WITH_VOX==1
+    _vox_end();
+#endif
+#if WITH_PEAK==1
+    peak_end();
+#endif
+    return;
+  }
+  gRecWriteCodec = gRecCodec;
+  gRecDegradePending = 0;
+  degrade = gRecDegradeCodec && ! gRecDecimShift;
+#if WITH_VOX==1
+  if (gVoxThreshold) degrade = 0;
+#endif
+  if (degrade) (void) wav_degrade_prepare((const char *)fname, gRecDegradeCodec);
 
   gState = STATE_RECORDING_TO_SD;
+  gRecNextSector = 0;
+  gRecScanSector = 0;
+#if WITH_CUE==1
+  // Markers count sampled frames, which VOX doesn't all keep
+#if WITH_VOX==1
+  cue_begin((const char *)fname, ! gVoxThreshold);
+#else
+  cue_begin((const char *)fname, 1);
+#endif
+#endif
 
   _rec_common(Fs, stereo, source);
 }
 
+// See REC_SOURCE_xxx for 'source'. Fs is the stream's sampling rate.
 void rec_to_SPI(uint16_t Fs, uint8_t stereo, uint8_t source)
 {
+  uint8_t channels = _rec_channels(stereo);
+
+  if ((channels == 4) && ! _rec_quad_ok(Fs, source, 1)) return;
+#if WITH_DECIM==1
+  gRecDecimShift = (source & REC_SOURCE_DECIM_MASK) >> REC_SOURCE_DECIM_SHIFT;
+  if (gRecDecimShift && ! _rec_decim_fits(Fs, channels, gRecDecimShift)) {
+    gRecDecimShift = 0;
+    (void) fail(FAIL_REC, FAIL_REC_RATE);
+    return;
+  }
+#endif
+  if (! adc_rate_ok(Fs << gRecDecimShift, _rec_type(channels, source))) return;
+  gRecSectorBytes = REC_SECTOR_SIZE;
   gState = STATE_RECORDING_TO_SPI;
 
   gSPIOutputBuffersFull=0;    // No buffers filled yet
@@ -90,13 +440,20 @@ uint8_t *rec_SPI_get_buffer(void)
   uint8_t *buf;
 
   buf = (uint8_t *)(gBuffers[gSPITailBuffer]) + gSPITailBufferIx;
+#if WITH_DCBLOCK==1
+  dcblock_apply((int16_t *)buf, SPI_STREAM_SIZE_BYTES/2);
+#endif
+#if WITH_AGC==1
+  if (gSPITailBufferIx == 0) agc_buffer_start(gSPITailBuffer);
+  agc_apply((int16_t *)buf, SPI_STREAM_SIZE_BYTES/2);
+#endif
 
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
     gSPIOutputBuffersFull--;
   }
 
   gSPITailBufferIx += SPI_STREAM_SIZE_BYTES;
-  if (gSPITailBufferIx >= BUFFER_SIZE) {
+  if (gSPITailBufferIx >= (BUFFER_SIZE >> gRecDecimShift)) {
     gSPITailBuffer = 1 - gSPITailBuffer;
     gSPITailBufferIx = 0;
   }
@@ -112,7 +469,54 @@ uint8_t rec_SPI_get_full_buffers(void)
 // Called when a DMA buffer has been fully recorded
 void rec_dma_isr(void)
 {
-  gSPIOutputBuffersFull += (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES);
+  gRecBlocks++;
+#if WITH_AGC==1
+  agc_dma_switch(gActiveDMABuffer);
+#endif
+  if ((gState == STATE_RECORDING_TO_SPI) && ! gRecDecimShift) {
+    gSPIOutputBuffersFull += (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES);
+  }
+}
+
+// When decimating, each DMA buffer is decimated here in the main loop and only then handed out
+// as 'J' packets, from its start
+void rec_SPI_process_buffer(void)
+{
+#if WITH_DECIM==1
+  if (gRecDecimShift && gDMABufferDone) {
+    gDMABufferDone = 0;
+    (void) decim_run((int16_t *)gBuffers[1-gActiveDMABuffer], BUFFER_SIZE/2);
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      gSPIOutputBuffersFull += (BUFFER_SIZE/SPI_STREAM_SIZE_BYTES) >> gRecDecimShift;
+    }
+  }
+#endif
+}
+
+// Sample frame position of the recording at a moment 'since' (a Stopwatch() value) in the
+// recent past. The DMA block count and transfer count give the position now, less the frames
+// converted since then.
+uint32_t rec_position(uint16_t since)
+{
+  DMA_CH_t *ch;
+  uint32_t blocks, frames, elapsed;
+  uint16_t remaining;
+
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    blocks = gRecBlocks;
+    ch = gActiveDMABuffer ? &DMA.CH1 : &DMA.CH0;
+    if (ch->CTRLB & DMA_CH_TRNIF_bm) { // Block done but its ISR hasn't run yet
+      blocks++;
+      ch = gActiveDMABuffer ? &DMA.CH0 : &DMA.CH1;
+    }
+    remaining = ch->TRFCNTL; // Read 16-bit registers low-byte first
+    remaining |= ch->TRFCNTH << 8;
+    elapsed = (uint16_t)(Stopwatch() - since);
+  }
+
+  frames = (blocks*BUFFER_SIZE + BUFFER_SIZE - remaining) >> (gRecFrameShift + gRecDecimShift);
+  elapsed = elapsed * gRecFs / (1000000UL/STOPWATCH_US_PER_TICK);
+  return (frames > elapsed) ? frames - elapsed : 0;
 }
 
 void rec_stop(void)
@@ -125,6 +529,12 @@ void rec_stop(void)
   rateclock_stop();
 
   if (gState == STATE_RECORDING_TO_SD) {
+#if WITH_VOX==1
+    _vox_end();
+#endif
+#if WITH_PEAK==1
+    peak_end();
+#endif
     wav_rec_finalize();
     f_close(&gFile);
   }
@@ -132,20 +542,233 @@ void rec_stop(void)
   gState = STATE_IDLE;
 }
 
+void rec_set_sector_flush(uint8_t enable)
+{
+  gRecSectorFlush = enable;
+}
+
+#if WITH_DECIM==1
+void rec_set_oversample(uint8_t factor)
+{
+  gRecOversample = factor;
+}
+#endif
+
+// 'codec' if it is compiled in, otherwise WAV_CODEC_PCM
+static WavCodec_t _rec_codec(uint8_t codec)
+{
+  switch (codec) {
+#if WITH_ADPCM==1
+    case WAV_CODEC_ADPCM:
+#endif
+#if WITH_PACK12==1
+    case WAV_CODEC_PACKED12:
+#endif
+      return codec;
+
+    default:
+      return WAV_CODEC_PCM;
+  }
+}
+
+void rec_set_codec(uint8_t codec)
+{
+  gRecCodec = _rec_codec(codec);
+}
+
+// Codec that a PCM SD recording degrades to when the card can't keep up, 0 (PCM) for none
+void rec_set_degrade(uint8_t codec)
+{
+  gRecDegradeCodec = _rec_codec(codec);
+}
+
+// Which sector of gBuffers[] DMA is filling right now, going by its transfer count. When a block
+// finishes, its channel's count is reloaded with BUFFER_SIZE and DMA moves on to the other
+// channel, so until the DMA ISR has run the pending block (TRNIF still set) says which buffer is
+// really being filled, as in rec_position().
+static uint8_t _rec_fill_sector(void)
+{
+  DMA_CH_t *ch;
+  uint8_t buf, sector;
+  uint16_t remaining;
+
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    buf = gActiveDMABuffer;
+    ch = buf ? &DMA.CH1 : &DMA.CH0;
+    if (ch->CTRLB & DMA_CH_TRNIF_bm) { // Block done but its ISR hasn't run yet
+      buf = 1 - buf;
+      ch = buf ? &DMA.CH1 : &DMA.CH0;
+    }
+    remaining = ch->TRFCNTL; // Read 16-bit registers low-byte first
+    remaining |= ch->TRFCNTH << 8;
+  }
+  // Should the count read 0 as the block finishes, DMA is at the start of the other buffer
+  sector = buf*(BUFFER_SIZE/REC_SECTOR_SIZE) + (BUFFER_SIZE - remaining)/REC_SECTOR_SIZE;
+  return (sector == REC_SECTORS) ? 0 : sector;
+}
+
+// Sectors are processed in place as soon as DMA has filled them ('fill' is the one being filled
+// now), before they can be judged by VOX, encoded or written
+static void _rec_process(uint8_t fill)
+{
+  int16_t *samples;
+
+  while (gRecScanSector != fill) {
+    samples = (int16_t *)((uint8_t *)gBuffers + gRecScanSector*REC_SECTOR_SIZE);
+#if WITH_DECIM==1
+    if (gRecDecimShift) decim_run(samples, REC_SECTOR_SIZE/2);
+#endif
+#if WITH_DCBLOCK==1
+    dcblock_apply(samples, gRecSectorBytes/2);
+#endif
+#if WITH_AGC==1
+    agc_apply(samples, gRecSectorBytes/2);
+#endif
+#if WITH_PEAK==1
+    if (peak_active()) peak_scan(samples, gRecSectorBytes/2);
+#endif
+    if (++gRecScanSector == REC_SECTORS) gRecScanSector = 0;
+  }
+}
+
+// Returns 1 if gBuffers[] sector gRecNextSector is to be written now, 0 if the writes have
+// caught up with DMA ('fill' is the sector being filled)
+static uint8_t _rec_sector_due(uint8_t fill)
+{
+#if WITH_VOX==1
+  if (gVoxThreshold) {
+    // Pass judgement on finished sectors until one is to be written
+    while (! gVoxToWrite) {
+      uint8_t sector = gRecNextSector + gVoxPending;
+
+      if (sector >= REC_SECTORS) sector -= REC_SECTORS;
+      if (sector == fill) return 0;
+      _vox_decide(sector);
+    }
+    gVoxToWrite--;
+    return 1;
+  }
+#endif
+  return gRecNextSector != fill;
+}
+
+// Sectors of gBuffers[] that DMA has filled and are still to be written from 'next' on, with
+// DMA filling sector 'fill'
+static uint8_t _rec_lag(uint8_t fill, uint8_t next)
+{
+  return (fill - next) & (REC_SECTORS-1);
+}
+
+// Switch a PCM SD recording to gRecDegradeCodec, if it was prepared for it, at the start of the
+// buffer that sector gRecNextSector begins. From then on whole buffers are written, starting
+// with that one: right away if DMA has filled it already, else once it has.
+static void _rec_degrade(void)
+{
+  gRecDegradePending = 0;
+  gRecWriteCodec = wav_degrade();
+  if (gRecWriteCodec != WAV_CODEC_PCM) {
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      gDMABufferDone = (gActiveDMABuffer != gRecNextSector/(BUFFER_SIZE/REC_SECTOR_SIZE));
+    }
+  }
+}
+
+// A header refresh, cue marker or peak spill, or a step of file rotation is only started right
+// after the writes have caught up with DMA, so it uses time that would otherwise be spent idling
+// until the next sector/buffer fills. With sector flushes, DMA can then get three more sectors
+// ahead before any data is lost.
+static void _rec_idle(void)
+{
+  if (wav_checkpoint_due()) {
+    if (! wav_checkpoint()) rec_stop();
+#if WITH_CUE==1
+  } else if (cue_spill_due()) {
+    sdlat_begin();
+    cue_spill();
+    sdlat_end();
+#endif
+#if WITH_PEAK==1
+  } else if (peak_spill_due()) {
+    sdlat_begin();
+    peak_spill();
+    sdlat_end();
+#endif
+  } else if (! wav_rotate_step()) {
+    rec_stop();
+  } else {
+    // At most one of these has anything to do: degrading is for f_write() recordings only
+    wav_preerase_step();
+    wav_degrade_step();
+  }
+}
+
 void rec_flush_buffer(void)
 {
+  if ((gRecSectorFlush && (gRecWriteCodec == WAV_CODEC_PCM)) || gRecDecimShift) {
+    uint8_t fill = _rec_fill_sector();
+
+    _rec_process(fill);
+
+    // One sector per call so SPI commands get a look-in between sectors
+    if (_rec_sector_due(fill)) {
+#if WITH_VOX==1
+      if (! _vox_kept(1)) {
+        rec_stop();
+        return;
+      }
+#endif
+      if (gRecDegradeCodec && (_rec_lag(fill, gRecNextSector) >= REC_DEGRADE_LAG)) gRecDegradePending = 1;
+      if (! wav_write((const uint8_t *)gBuffers + gRecNextSector*REC_SECTOR_SIZE, gRecSectorBytes)) {
+        rec_stop();
+        return;
+      }
+      if (++gRecNextSector == REC_SECTORS) gRecNextSector = 0;
+      if (gRecDegradePending && ! (gRecNextSector % (BUFFER_SIZE/REC_SECTOR_SIZE))) _rec_degrade();
+    } else {
+      _rec_idle();
+    }
+    return;
+  }
+
   if (gDMABufferDone) {
-    UINT bytesWritten;
-    FRESULT fresult;
+    uint8_t bufix = 1-gActiveDMABuffer;
+    uint8_t *buf = (uint8_t *)(gBuffers[bufix]);
+    UINT len = BUFFER_SIZE;
 
     // Data coming from the ADC's is essentially exactly what we want. Write it out.
     gDMABufferDone = 0;
-    fresult = f_write(&gFile, (const void *)(gBuffers[1-gActiveDMABuffer]), BUFFER_SIZE, &bytesWritten);
-    if ((fresult != FR_OK) || (bytesWritten != BUFFER_SIZE)) {
-      fail(FAIL_REC, FAIL_REC_BUFWRITE);
+    _rec_process(_rec_fill_sector()); // DMA is in the other buffer now, so this covers all of buf
+#if WITH_VOX==1
+    // Whole buffers are gated without pre-roll, as the other buffer is being overwritten
+    if (gVoxThreshold && ! _vox_gate(buf, BUFFER_SIZE)) {
+      gGapSectorsDropped += BUFFER_SIZE/REC_SECTOR_SIZE;
+      return;
+    }
+    if (! _vox_kept(BUFFER_SIZE/REC_SECTOR_SIZE)) {
+      rec_stop();
+      return;
+    }
+#endif
+#if WITH_ADPCM==1
+    if (gRecWriteCodec == WAV_CODEC_ADPCM) {
+      len = adpcm_encode(buf, BUFFER_SIZE);
+    }
+#endif
+#if WITH_PACK12==1
+    if (gRecWriteCodec == WAV_CODEC_PACKED12) {
+      len = pack12_pack(buf, BUFFER_SIZE);
+    }
+#endif
+    if (! wav_write(buf, len)) {
       rec_stop();
       return;
     }
+    // Once DMA is well into the buffer just written, the next buffer is encoded instead
+    if (gRecDegradeCodec && (gRecWriteCodec == WAV_CODEC_PCM)
+        && (_rec_lag(_rec_fill_sector(), (1-bufix)*(BUFFER_SIZE/REC_SECTOR_SIZE)) >= REC_DEGRADE_LAG)) {
+      gRecWriteCodec = wav_degrade();
+    }
+    if (! gDMABufferDone) _rec_idle();
   }
 }
 // vim: ts=2 sw=2 ai expandtab cindent
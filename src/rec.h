@@ -23,12 +23,27 @@
 #define _REC_H_
 
 #include "ff.h"
+#include "adcplan.h"
 
 typedef enum {
   REC_LINE,
-  REC_MIC
+  REC_MIC,
+  REC_QUAD    // MIC, LINE_L, LINE_R and the auxiliary input
 } RecType_t;
 
+// The 'stereo' byte of record_wav_file() and rec_to_SPI() ('R' and 'I' commands) is 0 for mono,
+// 1 for stereo or REC_STEREO_QUAD for four channels (REC_QUAD). Four channels go up to the rate
+// at which they write as many bytes per second as stereo at 44.1 kHz (see adcplan.py).
+#define REC_STEREO_QUAD   4
+#define REC_QUAD_MAX_FS   ADCPLAN_REC_MAX_FS_4
+
+// The 'source' byte of record_wav_file() and rec_to_SPI() ('R' and 'I' commands): bit 0 selects
+// the mic, and bits 4-5 can ask for the ADC to run 2, 4 or 8 times (1-3) faster than the file or
+// stream with decimation in between
+#define REC_SOURCE_MIC          0x01
+#define REC_SOURCE_DECIM_SHIFT  4
+#define REC_SOURCE_DECIM_MASK   0x30
+
 extern void record_wav_file(uint8_t source, uint16_t Fs, uint8_t stereo, const uint8_t *fname);
 extern void rec_init(void);
 extern void rec_stop(void);
@@ -36,8 +51,18 @@ extern void rec_begin(RecType_t type);
 extern void rec_to_SPI(uint16_t Fs, uint8_t stereo, uint8_t source);
 extern uint8_t *rec_SPI_get_buffer(void);
 extern uint8_t rec_SPI_get_full_buffers(void);
+extern void rec_SPI_process_buffer(void);
 extern void rec_flush_buffer(void);
+extern void rec_set_sector_flush(uint8_t enable);
+extern void rec_set_codec(uint8_t codec);
+extern void rec_set_degrade(uint8_t codec);
+extern void rec_set_oversample(uint8_t factor);
+extern void rec_set_vox_threshold(uint16_t level);
+extern void rec_set_vox_hang(uint16_t ms);
+extern void rec_set_vox_preroll(uint16_t ms);
+extern void rec_set_vox_gaps(uint8_t enable);
 extern void rec_dma_isr(void);
+extern uint32_t rec_position(uint16_t since);
 
 #endif // _REC_H_
 // vim: expandtab ts=2 sw=2 ai cindent
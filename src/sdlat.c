@@ -0,0 +1,99 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+/*
+ * This module keeps a histogram of how long SD card writes take while recording, so cards can be
+ * compared by their worst writes and not just by average throughput. A few long writes are what
+ * overrun the buffers. One write is whatever the main loop waits on the card for in one go: a
+ * buffer or sector of audio, a header or checkpoint update, a sidecar file (.CUE, .PEK, .GAP)
+ * spill, or a step of rotating or degrading to the next file. Timed writes can nest, e.g. the
+ * header update inside a checkpoint, and only the outermost one is counted.
+ *
+ * Buckets are an octave wide (see sdlat.h), so a duration is put in its bucket by counting its
+ * bits. Durations come from the free-running Stopwatch(), which wraps after 524ms, so anything
+ * that takes 0.5s or more going by the 10ms tick is counted in the last bucket instead.
+ *
+ * The histogram is cleared when a card is mounted and when it is read, so it describes one card.
+ */
+#include <inttypes.h>
+#include <string.h>
+#include <util/atomic.h>
+
+#include "config.h"
+#include "timer.h"
+#include "sdlat.h"
+
+#if WITH_SDLAT==1
+
+#define SDLAT_LONG_CS 50                // Tick10ms count from which a write goes in the last bucket
+
+static uint32_t gSDLatCount[SDLAT_BUCKETS];
+static uint16_t gSDLatStart;            // Stopwatch() when the write started
+static uint16_t gSDLatStartCs;          // Tick10ms when the write started
+static uint8_t gSDLatDepth;             // Timed writes in progress
+
+static uint16_t _centiseconds(void)
+{
+  uint16_t cs;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    cs = Tick10ms;
+  }
+  return cs;
+}
+
+// Call right before a write...
+void sdlat_begin(void)
+{
+  if (gSDLatDepth++) return;
+  gSDLatStartCs = _centiseconds();
+  gSDLatStart = Stopwatch();
+}
+
+// ...and right after it
+void sdlat_end(void)
+{
+  uint16_t ticks = Stopwatch() - gSDLatStart;
+  uint8_t bucket = 0;
+
+  if (--gSDLatDepth) return;
+  if ((uint16_t)(_centiseconds() - gSDLatStartCs) >= SDLAT_LONG_CS) {
+    bucket = SDLAT_BUCKETS-1;
+  } else {
+    for (ticks >>= 2; ticks; ticks >>= 1) bucket++;
+    if (bucket > SDLAT_BUCKETS-2) bucket = SDLAT_BUCKETS-2;
+  }
+  // The histogram is only read and cleared from the main loop (the '"' command), so no need to lock
+  gSDLatCount[bucket]++;
+}
+
+uint32_t sdlat_count(uint8_t bucket)
+{
+  return gSDLatCount[bucket];
+}
+
+void sdlat_reset(void)
+{
+  memset(gSDLatCount, 0, sizeof(gSDLatCount));
+}
+
+#endif // WITH_SDLAT
+// vim: expandtab ts=2 sw=2 ai cindent
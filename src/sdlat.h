@@ -0,0 +1,44 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+#ifndef _SDLAT_H_
+#define _SDLAT_H_
+
+#include <inttypes.h>
+#include "config.h"
+
+// Bucket b (1-14) counts writes that took 2^(b+1) to 2^(b+2)-1 Stopwatch() ticks, i.e., 32us to
+// 64us for bucket 1 doubling up to 262ms to 524ms for bucket 14. Bucket 0 is anything shorter
+// and bucket 15 anything from about 0.5s on.
+#define SDLAT_BUCKETS 16
+
+#if WITH_SDLAT==1
+extern void     sdlat_begin(void);
+extern void     sdlat_end(void);
+extern uint32_t sdlat_count(uint8_t bucket);
+extern void     sdlat_reset(void);
+#else
+static inline void sdlat_begin(void) {}
+static inline void sdlat_end(void) {}
+#endif
+
+#endif // _SDLAT_H_
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,225 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+
+/*
+ * This module implements the timeline sequencer. A timeline is a list of SeqEvent_t's sorted by
+ * sample clock value, either uploaded over SPI ('N') or read from a file on the SD card. Once
+ * started ('O'), events are executed from the main loop against the sample clock, so the
+ * Arduino is no longer in the timing path.
+ *
+ * There is only one playback voice (voice 0). A PLAY event is acted upon SEQ_LEAD_DIVISOR'th of
+ * a second early: the clip is opened and both ping-pong buffers filled, and the sample clock
+ * alarm then starts DMA exactly on time (see play_wav_file_at()). If the voice is still busy
+ * with the previous clip, the new clip can only be opened once the cue is due, so it starts
+ * late by the open time. Put a STOP event ahead of such cues to get exact timing.
+ */
+#include <string.h>
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+
+#include "config.h"
+#include "ff.h"
+#include "fail.h"
+#include "state.h"
+#include "play.h"
+#include "rateclock.h"
+#include "seq.h"
+
+#if WITH_SEQUENCER==1
+
+// Number of queued events. Must be a power of 2.
+#define SEQ_QUEUE_SIZE 16
+
+// Act on events this fraction of a second ahead of time
+#define SEQ_LEAD_DIVISOR 4
+
+static SeqEvent_t gSeqQueue[SEQ_QUEUE_SIZE];
+static uint8_t gSeqHead;      // Index of the next event to execute
+static uint8_t gSeqCount;     // Number of events in the queue
+static uint8_t gSeqRunning;   // Non-zero when the timeline is being executed
+static uint8_t gSeqFromFile;  // Non-zero while there are more events to read from gSeqFile
+static uint16_t gSeqLead;     // How many samples ahead of an event we act on it
+static FIL gSeqFile;
+
+static char gSeqClipName[] = "CLIP0000.WAV";
+
+static SeqEvent_t *_tail(void)
+{
+  return &gSeqQueue[(gSeqHead + gSeqCount) & (SEQ_QUEUE_SIZE-1)];
+}
+
+static const uint8_t *_clip_name(uint16_t clip)
+{
+  uint8_t i;
+
+  for (i=7; i >= 4; i--) {
+    gSeqClipName[i] = '0' + (clip % 10);
+    clip /= 10;
+  }
+  return (const uint8_t *)gSeqClipName;
+}
+
+// Keep the queue topped up from the timeline file. Only read when it is at least half
+// empty so that the SD card is not visited on every main loop iteration.
+static void _refill(void)
+{
+  UINT bytesRead;
+
+  if (!gSeqFromFile || (gSeqCount > SEQ_QUEUE_SIZE/2)) return;
+
+  while (gSeqCount < SEQ_QUEUE_SIZE) {
+    if ((f_read(&gSeqFile, _tail(), sizeof(SeqEvent_t), &bytesRead) != FR_OK)
+        || (bytesRead != sizeof(SeqEvent_t))) {
+      f_close(&gSeqFile);
+      gSeqFromFile = 0;
+      break;
+    }
+    gSeqCount++;
+  }
+}
+
+uint8_t seq_get_free_events(void)
+{
+  return SEQ_QUEUE_SIZE - gSeqCount;
+}
+
+uint8_t seq_add_event(const uint8_t *ev)
+{
+  if (gSeqFromFile || (gSeqCount == SEQ_QUEUE_SIZE)) return 0;
+
+  memcpy(_tail(), ev, sizeof(SeqEvent_t));
+  gSeqCount++;
+  return 1;
+}
+
+// Stop executing the timeline but keep whatever is queued
+static void _halt(void)
+{
+  if (gSeqFromFile) {
+    f_close(&gSeqFile);
+    gSeqFromFile = 0;
+  }
+  gSeqRunning = 0;
+}
+
+// Give up on starting a timeline. Events left over from a file are dropped, uploaded events are
+// kept so the start can be retried.
+static void _start_failed(const uint8_t *fname)
+{
+  if (*fname) {
+    seq_stop();
+  } else {
+    _halt();
+  }
+}
+
+// Start executing a timeline. If fname is empty, the events uploaded with seq_add_event() are
+// used. If Fs is non-zero, the sample clock timebase is (re)started at that rate so that event
+// times are relative to now, else event times are relative to the timebase already running.
+void seq_start(uint16_t Fs, const uint8_t *fname)
+{
+  uint16_t timebaseFs;
+
+  _halt();
+  (void) fail_major(FAIL_SEQ);
+
+  if (*fname) {
+    gSeqHead = gSeqCount = 0;
+    if (f_open(&gSeqFile, (const char *)fname, FA_READ | FA_OPEN_EXISTING) != FR_OK) {
+      fail_minor(FAIL_SEQ_NO_FILE);
+      return;
+    }
+    gSeqFromFile = 1;
+    _refill();
+  }
+
+  if (Fs && ! rateclock_timebase(Fs)) {
+    _start_failed(fname);
+    return;
+  }
+
+  timebaseFs = rateclock_timebase_rate();
+  if (timebaseFs == 0) {
+    fail_minor(FAIL_SEQ_NO_TIMEBASE);
+    _start_failed(fname);
+    return;
+  }
+  gSeqLead = timebaseFs / SEQ_LEAD_DIVISOR;
+
+  gSeqRunning = 1;
+  fail_nofail();
+}
+
+void seq_stop(void)
+{
+  _halt();
+  gSeqHead = gSeqCount = 0;
+}
+
+void seq_update(void)
+{
+  SeqEvent_t *ev;
+  int32_t until;
+
+  if (! gSeqRunning) return;
+
+  _refill();
+  if (gSeqCount == 0) {
+    if (! gSeqFromFile) gSeqRunning = 0; // Timeline exhausted
+    return;
+  }
+
+  ev = &gSeqQueue[gSeqHead];
+  until = (int32_t)(ev->mWhen - rateclock_samples());
+  if (until > (int32_t)gSeqLead) return; // Not yet
+
+  switch (ev->mOp) {
+    case SEQ_OP_PLAY:
+      if ((gState == STATE_PLAYING_FROM_SD) && (until <= 0)) {
+        play_stop(); // Previous clip still going, cut it off
+      }
+      if (gState != STATE_IDLE) {
+        if (until > 0) return; // Try again, the voice may free up before the cue is due
+        break; // Something else is going on (recording?), drop the cue
+      }
+      play_wav_file_at(_clip_name(ev->mClip), ev->mWhen);
+      play_set_gain(ev->mArg);
+      break;
+
+    case SEQ_OP_STOP:
+      if (ev->mArg == 0) {
+        play_stop_at(ev->mWhen);
+      }
+      break;
+
+    default:
+    case SEQ_OP_END:
+      seq_stop();
+      return;
+  }
+
+  gSeqHead = (gSeqHead + 1) & (SEQ_QUEUE_SIZE-1);
+  gSeqCount--;
+}
+
+#endif // WITH_SEQUENCER
+// vim: expandtab ts=2 sw=2 ai cindent
@@ -0,0 +1,49 @@
+/*
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+*/
+#ifndef _SEQ_H_
+#define _SEQ_H_
+
+#include <inttypes.h>
+
+typedef enum {
+  SEQ_OP_END,     // End of timeline
+  SEQ_OP_PLAY,    // Play clip CLIPnnnn.WAV at the given gain
+  SEQ_OP_STOP,    // Stop the given voice
+} SeqOp_t;
+
+// One timeline event. This is the format of the timeline file on SD card as well
+// as the 8-byte 'N' packet over SPI, so don't reorder.
+typedef struct {
+  uint32_t mWhen;   // Sample clock value at which the event takes effect
+  uint8_t  mOp;     // SeqOp_t
+  uint8_t  mArg;    // SEQ_OP_PLAY: gain (128 is unity). SEQ_OP_STOP: voice number.
+  uint16_t mClip;   // SEQ_OP_PLAY: clip number nnnn
+} SeqEvent_t;
+
+extern void    seq_start(uint16_t Fs, const uint8_t *fname);
+extern void    seq_stop(void);
+extern void    seq_update(void);
+extern uint8_t seq_add_event(const uint8_t *ev);
+extern uint8_t seq_get_free_events(void);
+
+#endif // _SEQ_H_
+// vim: expandtab ts=2 sw=2 ai cindent
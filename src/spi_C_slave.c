@@ -41,6 +41,14 @@
 #include "pass.h"
 #include "bootloader.h"
 #include "wavwrite.h"
+#include "rateclock.h"
+#include "seq.h"
+#include "timer.h"
+#include "cue.h"
+#include "peak.h"
+#include "dcblock.h"
+#include "agc.h"
+#include "sdlat.h"
 
 #if WITH_SPI==1
 
@@ -48,6 +56,7 @@
 static volatile uint8_t *spiBufPtr; // Address of next location in spiBuf where incoming data will be stored
 static volatile uint8_t spiBufCount; // Bytes to receive before transaction is complete
 static volatile uint8_t spiExchangeUpdate; // Set to true in ISR if an entire SPI packet is done
+static volatile uint16_t spiExchangeTime; // Stopwatch() when the last byte of the packet arrived
 static uint8_t spiCommand;  // Remember the command that was received while processing its data
 
 static enum {  // Indicate what the latest SPI exchange is giving us, a 1-byte command or followup data
@@ -128,7 +137,6 @@ static void _transmit_u16(uint16_t val)
 #endif
 }
 
-#if 0
 static void _transmit_u32(uint32_t val)
 {
 #if 0
@@ -143,11 +151,10 @@ static void _transmit_u32(uint32_t val)
   *spiBufPtr++ = (uint8_t) (val32.byte[2]);
   *spiBufPtr++ = (uint8_t) (val32.byte[3]);
 #else
-  memcpy(spiBufPtr, &val, sizeof(val));
+  memcpy((uint8_t *)spiBufPtr, &val, sizeof(val));
   spiBufPtr += sizeof(val);
 #endif
 }
-#endif
 
 #if 0
 static void _transmit_fill(uint8_t fillchar, uint8_t count)
@@ -187,6 +194,15 @@ uint16_t _read_u16(void)
 #endif
 }
 
+static uint32_t _read_u32(void)
+{
+  uint32_t lword;
+
+  memcpy(&lword, (const uint8_t *)spiBufPtr, sizeof(lword));
+  spiBufPtr += sizeof(lword);
+  return lword;
+}
+
 static uint8_t inline _read_u8(void)
 {
   return *spiBufPtr++;
@@ -196,14 +212,14 @@ static uint8_t inline _read_u8(void)
    Command reference:
 
    ! : Reboot and possibly load alternate program
-   " :
-   # :
-   $ :
-   % :
-   & :
-   ' :
-   ( :
-   ) :
+   " : Get and clear the SD write latency histogram
+   # : Get playback underrun statistics
+   $ : Get command-to-first-sample latency of last SD playback
+   % : Get SD write and pre-erase timing of the current/last recording
+   & : Set a cue marker in the current SD recording
+   ' : Get DC blocker cost for the current/last recording
+   ( : Set the first entry for ')'
+   ) : Get entries of the waveform overview of the current/last recording
    * : Synchronize SPI
    + :
    , :
@@ -238,27 +254,28 @@ static uint8_t inline _read_u8(void)
    I : Stream SPI from line/mic
    J : Receive stream SPI packet from line/mic
    K : Receive count of how many SPI packets are available for streaming to SPI from line/mic
-   L :
-   M :
-   N :
-   O :
+   L : Start/stop the free-running sample clock timebase
+   M : Set a playback/recording option
+   N : Upload a timeline event for the sequencer
+   O : Start the sequencer
    P : Play WAV file from SD card
    Q : Stop current activity and return to idle mode
    R : Record WAV file to SD card
    S : Presize file on SD card
    T : Serial Tx enable/disable
-   U :
+   U : Get 32-bit sample clock
    V : Set headphone volume
-   W :
-   X :
-   Y :
+   W : Play WAV file from SD card in reverse
+   X : Play WAV file from SD card starting at a sample clock value
+   Y : Stop SD playback at a sample clock value
    Z : Get program version, SD card status, etc.
  */
 static void _handleData(void)
 {
   uint8_t line, mic;
   uint16_t Fs;
-  uint8_t stereo, source;
+  uint8_t stereo, source, option;
+  uint32_t when;
 
   switch (spiCommand) {
     default:
@@ -314,11 +331,153 @@ static void _handleData(void)
       break;
 
     case 'P':   // 'P': Play WAV file...specify 8.3 --> 13 characters including NULL
+      play_latency_mark(spiExchangeTime);
       play_wav_file((const uint8_t *)spiBuf);
       break;
 
+#if WITH_PEAK==1
+    case '(':   // '(': Set first waveform overview entry to get with ')'. 4 bytes of entry number
+      peak_seek(_read_u32());
+      break;
+#endif
+
+    case 'M':   // 'M': Set option. 1 byte of option ID, 4 bytes of value
+      option = _read_u8();
+      when = _read_u32();
+      switch (option) {
+        case OPTION_PLAY_FAST_START:
+          play_set_fast_start(when != 0);
+          break;
+
+        case OPTION_REC_RAW:
+          wav_set_raw(when != 0);
+          break;
+
+        case OPTION_REC_PREERASE:
+          wav_set_preerase(when != 0);
+          break;
+
+        case OPTION_REC_RING:
+          wav_set_ring(when != 0);
+          break;
+
+#if WITH_DCBLOCK==1
+        case OPTION_REC_DC_BLOCK:
+          dcblock_set(when != 0);
+          break;
+#endif
+
+#if WITH_DECIM==1
+        case OPTION_REC_OVERSAMPLE:
+          rec_set_oversample((uint8_t)((when > 255) ? 255 : when));
+          break;
+#endif
+
+#if WITH_AGC==1
+        case OPTION_REC_AGC_TARGET:
+          agc_set_target((uint16_t)when);
+          break;
+
+        case OPTION_REC_AGC_ATTACK:
+          agc_set_attack((uint16_t)when);
+          break;
+
+        case OPTION_REC_AGC_RELEASE:
+          agc_set_release((uint16_t)when);
+          break;
+
+        case OPTION_REC_AGC_COARSE:
+          agc_set_coarse(when != 0);
+          break;
+#endif
+
+#if WITH_PEAK==1
+        case OPTION_REC_PEAK_FRAMES:
+          peak_set_frames((uint16_t)when);
+          break;
+#endif
+
+        case OPTION_REC_SECTOR_FLUSH:
+          rec_set_sector_flush(when != 0);
+          break;
+
+        case OPTION_REC_CHECKPOINT:
+          wav_set_checkpoint((uint16_t)when);
+          break;
+
+        case OPTION_REC_CODEC:
+          rec_set_codec((uint8_t)when);
+          break;
+
+        case OPTION_REC_DEGRADE:
+          rec_set_degrade((uint8_t)when);
+          break;
+
+        case OPTION_REC_ROTATE_SECONDS:
+          wav_set_rotate_seconds(when);
+          break;
+
+        case OPTION_REC_ROTATE_MEGABYTES:
+          wav_set_rotate_megabytes((uint16_t)when);
+          break;
+
+        case OPTION_ADC_PRESCALER:
+          adc_set_prescaler((when > 512) ? 0 : (uint16_t)when);
+          break;
+
+#if WITH_VOX==1
+        case OPTION_REC_VOX_THRESHOLD:
+          rec_set_vox_threshold((uint16_t)when);
+          break;
+
+        case OPTION_REC_VOX_HANG:
+          rec_set_vox_hang((uint16_t)when);
+          break;
+
+        case OPTION_REC_VOX_PREROLL:
+          rec_set_vox_preroll((uint16_t)when);
+          break;
+
+        case OPTION_REC_VOX_GAPS:
+          rec_set_vox_gaps(when != 0);
+          break;
+#endif
+
+        default:
+          break;
+      }
+      break;
+
+    case 'W':   // 'W': Play WAV file in reverse...specify 8.3 --> 13 characters including NULL
+      play_wav_file_reversed((const uint8_t *)spiBuf);
+      break;
+
+    case 'X':   // 'X': Play WAV file at sample clock value...then 8.3 filename as for 'P'
+      when = _read_u32();
+      play_wav_file_at((const uint8_t *)spiBufPtr, when);
+      break;
+
+    case 'Y':   // 'Y': Stop SD playback at sample clock value
+      play_stop_at(_read_u32());
+      break;
+
+#if WITH_SEQUENCER==1
+    case 'N':   // 'N': Timeline event for the sequencer
+      (void) seq_add_event((const uint8_t *)spiBufPtr);
+      break;
+
+    case 'O':   // 'O': Start sequencer. Sampling rate (0 to use running timebase), then timeline filename (empty for uploaded events)
+      Fs = _read_u16();
+      seq_start(Fs, (const uint8_t *)spiBufPtr);
+      break;
+#endif
+
+    case 'L':   // 'L': Start sample clock timebase at given sampling rate, or stop it if 0
+      (void) rateclock_timebase(_read_u16());
+      break;
+
     case 'C':   // 'C': Play stream from SPI...specify sampling rate and mono/stereo
-    case 'I':   // 'I': Stream line/mic to SPI...specify sampling rate, mono/stereo, source
+    case 'I':   // 'I': Stream line/mic to SPI...specify sampling rate, mono/stereo/REC_STEREO_QUAD, source (REC_SOURCE_xxx)
       Fs = _read_u16();
       stereo = _read_u8();
       if (spiCommand=='C') {
@@ -348,7 +507,7 @@ static void _handleData(void)
       play_SPI_add_buffer((const uint8_t *)spiBufPtr);
       break;
 
-    case 'R':   // 'R': Record to WAV file
+    case 'R':   // 'R': Record to WAV file...sampling rate, mono/stereo/REC_STEREO_QUAD, source (REC_SOURCE_xxx), filename
       Fs = _read_u16();
       stereo = _read_u8();
       source = _read_u8();
@@ -380,10 +539,82 @@ static void _handleCommand(void)
       break;
 
     case 'A':     // 'A': Set ADC gains for line and mic
+    case 'L':     // 'L': Start/stop sample clock timebase. Parameter is sampling rate.
       _transmit_empty(2);
       _accept_data();
       break;
 
+    case 'Y':     // 'Y': Stop SD playback at given sample clock value
+      _transmit_empty(4);
+      _accept_data();
+      break;
+
+    case 'M':     // 'M': Set option. Option ID then 32-bit value.
+      _transmit_empty(5);
+      _accept_data();
+      break;
+
+    case '#':     // '#': Request playback underrun statistics for the current/last session
+      {
+        uint16_t underruns, concealed;
+        uint32_t blocks;
+
+        play_get_underruns(&underruns, &concealed, &blocks);
+        _transmit_u16(underruns);
+        _transmit_u16(concealed);
+        _transmit_u32(blocks);
+      }
+      _accept_data();
+      break;
+
+    case '$':     // '$': Request latency of the last SD playback start, in 8us Stopwatch() ticks
+      {
+        uint16_t open, read, total;
+
+        play_get_latency(&open, &read, &total);
+        _transmit_u16(open);
+        _transmit_u16(read);
+        _transmit_u16(total);
+      }
+      _accept_data();
+      break;
+
+    case '%':     // '%': Request SD write timing for the current/last recording, in 8us Stopwatch() ticks
+      {
+        uint8_t erased;
+        uint32_t count, ticks;
+        uint16_t max;
+
+        wav_get_write_stats(&erased, &count, &ticks, &max);
+        _transmit_u8(erased);
+        _transmit_u32(count);
+        _transmit_u32(ticks);
+        _transmit_u16(max);
+
+        wav_get_erase_stats(&count, &ticks);
+        _transmit_u32(count);
+        _transmit_u32(ticks);
+      }
+      _accept_data();
+      break;
+
+#if WITH_SDLAT==1
+    case '"':     // '"': Request SD write latency histogram, SDLAT_BUCKETS counts, then clear it
+      {
+        uint8_t i;
+
+        for (i=0; i < SDLAT_BUCKETS; i++) _transmit_u32(sdlat_count(i));
+        sdlat_reset();
+      }
+      _accept_data();
+      break;
+#endif
+
+    case 'U':     // 'U': Request current sample clock value
+      _transmit_u32(rateclock_samples());
+      _accept_data();
+      break;
+
     case 'C':     // 'C': Stream audio over SPI to headphones
       _transmit_empty(3); // Specify sampling rate and mono/stereo
       _accept_data();
@@ -406,17 +637,20 @@ static void _handleCommand(void)
       break;
 
     case 'P':     // 'P': Play WAV from SD
+    case 'W':     // 'W': Play WAV from SD in reverse
     case '!':     // '!': Replace application with given filename through bootloader
       _transmit_empty(13); // Filename in 8.3 format, zero-padded
       _accept_data();
       break;
 
     case 'S':     // 'S': presize file on SD card. Parameter is number of MEGABYTES to presize.
+    case 'O':     // 'O': Start sequencer. 2 bytes for sampling rate, 13 chars for timeline filename.
       _transmit_empty(15); // 2 bytes for how many megabytes to presize, 13 chars for filename
       _accept_data();
       break;
 
     case 'R':     // 'R': Record WAV from SD
+    case 'X':     // 'X': Play WAV from SD at a sample clock value. 4 bytes of sample clock value then filename.
       _transmit_empty(17); // Source (line or mic), mono/stereo, sampling rate, then filename in 8.3 format, zero-padded
       _accept_data();
       break;
@@ -433,6 +667,14 @@ static void _handleCommand(void)
       _accept_data();
       break;
 
+#if WITH_SEQUENCER==1
+    case 'N':     // 'N': Timeline event for sequencer. Return how many free event slots there are.
+      _transmit_u8(seq_get_free_events()-1); // This is how many slots are left AFTER receiving this event
+      _transmit_empty(sizeof(SeqEvent_t)-1);
+      _accept_data();
+      break;
+#endif
+
     case 'E':     // 'E': Return last failure codes
       _transmit_u8(gFailMajor);
       _transmit_u8(gFailMinor);
@@ -441,6 +683,44 @@ static void _handleCommand(void)
       break;
 
 
+#if WITH_DCBLOCK==1
+    case '\'':    // '\'': Request DC blocker cost: samples filtered, then 8us Stopwatch() ticks spent on them
+      {
+        uint32_t samples, ticks;
+
+        dcblock_get_cost(&samples, &ticks);
+        _transmit_u32(samples);
+        _transmit_u32(ticks);
+      }
+      _accept_data();
+      break;
+#endif
+
+#if WITH_PEAK==1
+    case '(':     // '(': Set first waveform overview entry to get with ')'. Entry number follows.
+      _transmit_empty(4);
+      _accept_data();
+      break;
+
+    case ')':     // ')': Request waveform overview entries. Returns a count then that many min/max byte pairs,
+                  //      or PEAK_FETCH_NOT_READY if the entries are only on the card while recording.
+      {
+        uint8_t count = peak_fetch((uint8_t *)spiBufPtr + 1, PEAK_FETCH_ENTRIES);
+
+        _transmit_u8(count);
+        _transmit_empty(2*PEAK_FETCH_ENTRIES);
+      }
+      _accept_data();
+      break;
+#endif
+
+#if WITH_CUE==1
+    case '&':     // '&': Set a cue marker at this moment of the SD recording. Return its number, 0 if none.
+      _transmit_u16((gState == STATE_RECORDING_TO_SD) ? cue_mark(rec_position(spiExchangeTime)) : 0);
+      _accept_data();
+      break;
+#endif
+
     case 'K':     // 'K': Request count of how many SPI stream packets from line/mic are available
       _transmit_u8(rec_SPI_get_full_buffers());
       _accept_data();
@@ -452,6 +732,9 @@ static void _handleCommand(void)
       break;
 
     case 'Q':     // 'Q': Stop whatever you're doing (playing, recording, etc.)
+#if WITH_SEQUENCER==1
+      seq_stop();
+#endif
       switch (gState) {
         case STATE_RECORDING_TO_SD:
         case STATE_RECORDING_TO_SPI:
@@ -503,6 +786,7 @@ ISR(SPIC_INT_vect)
     if (--spiBufCount == 0) {
       SPIC.DATA = STATE_BUSY; // In case we get '?' queries right away
       spiBufPtr = spiBuf;
+      spiExchangeTime = Stopwatch();
       spiExchangeUpdate = 1;
     }
   } else SPIC.DATA = STATE_BUSY;
@@ -22,6 +22,33 @@
 #ifndef _SPI_C_H_
 #define _SPI_C_H_
 
+// Option IDs for the 'M' command. These integers are hard-coded into the Arduino library
+// so don't change them, only add to the end.
+typedef enum {
+  OPTION_PLAY_FAST_START,     // Non-zero: 'P' starts output once enough of the first buffer is read
+  OPTION_REC_RAW,             // Non-zero: 'R' into a file presized with 'S' writes sectors directly
+  OPTION_REC_PREERASE,        // Non-zero: keep erasing the presized file ahead of a raw recording
+  OPTION_REC_SECTOR_FLUSH,    // Non-zero (default): write each sector as it fills, zero: whole buffers
+  OPTION_REC_CHECKPOINT,      // Seconds between WAV header refreshes while recording, 0 for none
+  OPTION_REC_CODEC,           // WavCodec_t for 'R': 0 for 16-bit PCM, 1 for IMA ADPCM, 2 for packed 12-bit
+  OPTION_REC_VOX_THRESHOLD,   // VOX: peak sample magnitude (0-32767) that starts writing, 0 to record everything
+  OPTION_REC_VOX_HANG,        // VOX: milliseconds of quiet after which writing stops again
+  OPTION_REC_VOX_PREROLL,     // VOX: milliseconds of audio before the trigger to write as well
+  OPTION_REC_VOX_GAPS,        // VOX: non-zero to log dropped audio to a .GAP file so timing can be restored
+  OPTION_REC_ROTATE_SECONDS,  // Start a new numbered file after this many seconds, 0 for no time limit
+  OPTION_REC_ROTATE_MEGABYTES,// Start a new numbered file after this many megabytes, 0 for no size limit
+  OPTION_REC_RING,            // Non-zero: raw recording loops around its presized file, 'Q' keeps the latest audio
+  OPTION_REC_PEAK_FRAMES,     // Sample frames per min/max entry of the .PEK overview file, 0 for none
+  OPTION_REC_DC_BLOCK,        // Non-zero: remove DC offset from SD recordings and 'J' packets
+  OPTION_REC_AGC_TARGET,      // AGC target peak level (0..32767), 0 to disable AGC
+  OPTION_REC_AGC_ATTACK,      // AGC time constant in ms when reducing gain
+  OPTION_REC_AGC_RELEASE,     // AGC time constant in ms when increasing gain
+  OPTION_REC_AGC_COARSE,      // Non-zero: AGC also steps the ADC gain (1X/2X/4X/8X), not for 4 channels or stereo mic
+  OPTION_REC_OVERSAMPLE,      // Largest oversampling factor (2, 4 or 8) for PCM SD recordings, 0 for none
+  OPTION_REC_DEGRADE,         // WavCodec_t a PCM SD recording switches to when the card can't keep up, 0 for none
+  OPTION_ADC_PRESCALER,       // ADC clock divider (4-512) to measure instead of adcplan.py's, 0 for the plan's
+} Option_t;
+
 extern void SPI_C_Init(void);
 extern void SPI_C_Update(void);
 
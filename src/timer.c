@@ -129,6 +129,20 @@ void TimerInit(void)
   wait_for_sync();
 }
 
+#if BOOTLOADER==0
+// Start TCD0 free-running at 32 MHz/256 so Stopwatch() reads in 8us ticks, wrapping every 524ms.
+// Besides measuring latencies and SD card timing, recording depends on it: rec_position() dates
+// cue markers back to when their SPI command came in, and wavwrite.c bounds each step of
+// allocating the next rotated file with it. So TCD0 must keep running, with this prescaler,
+// whenever recording can happen: don't repurpose it or turn it off to save power.
+void StopwatchInit(void)
+{
+  TCD0.CTRLB = TC_WGMODE_NORMAL_gc;
+  TCD0.PER = 0xFFFF;
+  TCD0.CTRLA = TC_CLKSEL_DIV256_gc;
+}
+#endif
+
 // Rough delay function that actually delays by 10ms chunks, and rounds up to the nearest
 // 10ms chunk. E.g., delaycentiseconds(0) will delay for anywhere between 0ms and 10ms, delaycentiseconds(1)
 // will delay for anywhere between 10ms and 20ms, etc.
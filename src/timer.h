@@ -31,6 +31,15 @@ extern void TimerInit(void);
 extern void delaycentiseconds(uint16_t centiseconds);
 
 #if BOOTLOADER==0
+#include <avr/io.h>
+
+// Stopwatch() ticks are 256 CPU clocks at 32 MHz
+#define STOPWATCH_US_PER_TICK 8
+#define STOPWATCH_CLOCKS_PER_TICK 256
+
+extern void StopwatchInit(void);
+static inline uint16_t Stopwatch(void) { return TCD0.CNT; }
+
 extern uint8_t IsAlarm1(void);
 extern void SetAlarm1(uint16_t centiseconds);
 extern void rtc_interrupt(uint8_t ison);
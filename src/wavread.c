@@ -31,7 +31,11 @@
 #include "buffers.h"
 #include "wavread.h"
 #include "ff.h"
+#include "diskio.h"
+#include "clmap.h"
+#include "pack12.h"
 #include "fail.h"
+#include "rateclock.h"
 
 // WAV info structure used for playing, recording, ...
 WAVInfo_t gWAVInfo;
@@ -42,6 +46,21 @@ FIL gFile;
 // Number of bytes left to read in the current data chunk
 static uint32_t gChunkBytesRemaining;
 
+// For reverse playback: file offset of the first byte of audio data
+static DWORD gDataStart;
+
+// For reverse playback: how to get at the data. 0 for forward playback.
+static enum {
+  WAV_FORWARD=0,
+  WAV_FORWARD_PACKED12, // Packed 12-bit data, unpacked to 16-bit as it is read
+  WAV_REVERSE_MAPPED,   // Sectors are located with the cluster map
+  WAV_REVERSE_SEEK,     // File too fragmented to map, have to f_lseek() backwards (slow)
+} gReadMode;
+
+// Fast start: least playing time, in ms, that DMA is started on. It covers reading the rest of
+// the first buffer (two sector accesses) from a slow card and preparing it. See faststartsim.py.
+#define WAV_FAST_START_LEAD_MS 8
+
 // Open a WAV file, parse the chunks, and prepare to start reading audio data
 // Returns 0 if failure, 1 if successful.
 // NOTE: It uses one of the global ping-pong buffers for temporary storage
@@ -54,6 +73,7 @@ uint8_t wav_open(const char *fname)
 
   (void) fail_major(FAIL_WAV_OPEN);
 
+  gReadMode = WAV_FORWARD;
   fresult = f_open(&gFile, fname, FA_READ | FA_OPEN_EXISTING);
   if (fresult != FR_OK) return fail_minor(FAIL_WAV_NO_FILE);
 
@@ -77,31 +97,122 @@ uint8_t wav_open(const char *fname)
   if (lChunkSize < 16) return fail_minor(FAIL_WAV_BAD_FMT);
 
   // Bytes 20-21: audio format, should be 1 for PCM, something else for compression
+#if WITH_PACK12==1
+  if (*(uint16_t *)(buf+20) == WAVE_FORMAT_PACKED12) {
+    gReadMode = WAV_FORWARD_PACKED12;
+  } else
+#endif
   if (*(uint16_t *)(buf+20) != 1) return fail_minor(FAIL_WAV_NOT_PCM);
 
   // Bytes 22-36: number of channels, sample rate, byte rate, block alignment, bits per sample
   memcpy(& (gWAVInfo.mChannels), buf+22, 14);
+  if ((gWAVInfo.mSamplingRate < RATECLOCK_MIN_FS) || (gWAVInfo.mSamplingRate > 65535UL)) return fail_minor(FAIL_WAV_BAD_FMT);
 
   // If chunk size is not 16, skip to the end of the chunk
   //if (lChunkSize > 16) {
     f_lseek(&gFile, f_tell(&gFile) + (lChunkSize-16));
   //}
 
-  // Now read data chunk
-  fresult = f_read(&gFile, buf, 8, &bytesRead);
-  if ((fresult != FR_OK) || (bytesRead<8)) return fail_minor(FAIL_WAV_NO_DATA);
+  // Now read data chunk, skipping any padding or other chunks in front of it
+  while (1) {
+    fresult = f_read(&gFile, buf, 8, &bytesRead);
+    if ((fresult != FR_OK) || (bytesRead<8)) return fail_minor(FAIL_WAV_NO_DATA);
+
+    if (! memcmp_P(buf, PSTR("data"), 4)) break;
 
-  if (memcmp_P(buf, PSTR("data"), 4)) return fail_minor(FAIL_WAV_BAD_DATA);
+    fresult = f_lseek(&gFile, f_tell(&gFile) + ((*(uint32_t *)(buf+4) + 1) & ~1UL));
+    if (fresult != FR_OK) return fail_minor(FAIL_WAV_SEEK);
+  }
 
   gChunkBytesRemaining = *(uint32_t *)(buf+4);
 
   return fail_nofail();
 }
 
-uint8_t wav_fill_buffer(uint16_t *buf, UINT *bytesRead)
+// Switch an open WAV file to reverse playback: the data chunk is read from end to start and
+// each block has its sample frames reversed. Returns 0 if failure, 1 if successful.
+uint8_t wav_reverse(void)
+{
+  DWORD available;
+
+  (void) fail_major(FAIL_WAV_OPEN);
+
+  // Frames must not straddle sectors, which holds for 16-bit mono/stereo with an aligned data chunk
+  gDataStart = f_tell(&gFile);
+  if ((gWAVInfo.mBitsPerSample != 16)
+      || ((gWAVInfo.mBlockAlignment != 2) && (gWAVInfo.mBlockAlignment != 4))
+      || (gDataStart % gWAVInfo.mBlockAlignment)) {
+    return fail_minor(FAIL_WAV_NO_REVERSE);
+  }
+
+  // Don't trust the chunk size beyond the end of the file, and only play whole frames
+  available = f_size(&gFile) - gDataStart;
+  if (gChunkBytesRemaining > available) gChunkBytesRemaining = available;
+  gChunkBytesRemaining -= gChunkBytesRemaining % gWAVInfo.mBlockAlignment;
+
+  gReadMode = clmap_build(&gFile) ? WAV_REVERSE_MAPPED : WAV_REVERSE_SEEK;
+
+  return fail_nofail();
+}
+
+// Read a range of the file using the cluster map. Whole sectors are read straight into the
+// destination, as many at a time as are contiguous. Partial sectors at either end go through
+// the FatFs window, which then still holds the sector for the adjacent block.
+static uint8_t _read_mapped(uint8_t *dst, DWORD ofs, UINT len)
+{
+  DWORD sect, contig;
+  UINT n, count;
+  uint8_t *win;
+
+  while (len) {
+    sect = clmap_sector(ofs, &contig);
+    if (sect == 0) return 0;
+
+    n = (UINT)(ofs % 512);
+    if (n || (len < 512)) {
+      count = 512 - n;
+      if (count > len) count = len;
+      if (! (win = clmap_window(sect))) return 0;
+      memcpy(dst, win + n, count);
+    } else {
+      count = len / 512;
+      if (count > contig) count = contig;
+      if (disk_read(gFile.fs->drv, dst, sect, (BYTE)count) != RES_OK) return 0;
+      count *= 512;
+    }
+    dst += count;
+    ofs += count;
+    len -= count;
+  }
+  return 1;
+}
+
+// Reverse the order of the sample frames in a buffer
+static void _reverse_frames(uint8_t *buf, UINT len)
+{
+  if (gWAVInfo.mBlockAlignment == 4) {
+    uint32_t *lo = (uint32_t *)buf, *hi = (uint32_t *)(buf + len) - 1;
+    uint32_t tmp;
+
+    for ( ; lo < hi; lo++, hi--) {
+      tmp = *lo; *lo = *hi; *hi = tmp;
+    }
+  } else {
+    uint16_t *lo = (uint16_t *)buf, *hi = (uint16_t *)(buf + len) - 1;
+    uint16_t tmp;
+
+    for ( ; lo < hi; lo++, hi--) {
+      tmp = *lo; *lo = *hi; *hi = tmp;
+    }
+  }
+}
+
+// Reverse-playback counterpart of the forward path in wav_fill_buffer(). Blocks are taken
+// from the end of the data chunk working backwards.
+static uint8_t _fill_buffer_reverse(uint16_t *buf, UINT *bytesRead)
 {
   UINT bytesActuallyRead;
-  FRESULT fresult;
+  DWORD ofs;
 
   *bytesRead = BUFFER_SIZE;
   if (BUFFER_SIZE > gChunkBytesRemaining) {
@@ -110,10 +221,88 @@ uint8_t wav_fill_buffer(uint16_t *buf, UINT *bytesRead)
   gChunkBytesRemaining -= *bytesRead;
   if (*bytesRead == 0) return 1;
 
+  ofs = gDataStart + gChunkBytesRemaining;
+  if (gReadMode == WAV_REVERSE_MAPPED) {
+    if (! _read_mapped((uint8_t *)buf, ofs, *bytesRead)) return fail(FAIL_WAV_READ, 0);
+  } else {
+    if ((f_lseek(&gFile, ofs) != FR_OK)
+        || (f_read(&gFile, buf, *bytesRead, &bytesActuallyRead) != FR_OK)
+        || (bytesActuallyRead < *bytesRead)) return fail(FAIL_WAV_READ, 0);
+  }
+
+  _reverse_frames((uint8_t *)buf, *bytesRead);
+  return 1;
+}
+
+// Read up to 'len' bytes of audio data in the forward direction. Fewer bytes are returned
+// in *bytesRead only at the end of the data chunk.
+uint8_t wav_read(uint8_t *buf, UINT len, UINT *bytesRead)
+{
+  UINT bytesActuallyRead;
+  FRESULT fresult;
+
+  *bytesRead = len;
+  if (len > gChunkBytesRemaining) {
+    *bytesRead = (UINT) gChunkBytesRemaining;
+  }
+  gChunkBytesRemaining -= *bytesRead;
+  if (*bytesRead == 0) return 1;
+
   fresult = f_read(&gFile, buf, *bytesRead, &bytesActuallyRead);
   if ((fresult != FR_OK) || (bytesActuallyRead < *bytesRead)) return fail(FAIL_WAV_READ, 0);
 
   return 1;
 }
 
+#if WITH_PACK12==1
+// Read a buffer's worth of packed 12-bit data into the end of the buffer and unpack it
+static uint8_t _fill_buffer_packed12(uint16_t *buf, UINT *bytesRead)
+{
+  uint8_t *dst = (uint8_t *)buf + BUFFER_SIZE - PACK12_PACKED_SIZE(BUFFER_SIZE);
+  UINT n;
+
+  if (! wav_read(dst, PACK12_PACKED_SIZE(BUFFER_SIZE), bytesRead)) return 0;
+
+  // A short last read is moved up so it ends where its unpacked samples will end. A partial
+  // sample pair at the end of a cut-off file is dropped.
+  n = *bytesRead - (*bytesRead % 3);
+  if (n < PACK12_PACKED_SIZE(BUFFER_SIZE)) {
+    memmove((uint8_t *)buf + PACK12_UNPACKED_SIZE(n) - n, dst, n);
+  }
+  *bytesRead = pack12_unpack((uint8_t *)buf, n);
+  return 1;
+}
+#endif
+
+uint8_t wav_fill_buffer(uint16_t *buf, UINT *bytesRead)
+{
+#if WITH_PACK12==1
+  if (gReadMode == WAV_FORWARD_PACKED12) return _fill_buffer_packed12(buf, bytesRead);
+#endif
+  if (gReadMode != WAV_FORWARD) return _fill_buffer_reverse(buf, bytesRead);
+
+  return wav_read((uint8_t *)buf, BUFFER_SIZE, bytesRead);
+}
+
+// For a fast start: the number of bytes to read before DMA starts, up to the end of the sector
+// the file pointer is in, or of the next one if that is less than WAV_FAST_START_LEAD_MS of
+// audio. The rest of the buffer (at most two sector accesses) is read while those bytes play.
+// Returns 0 if a fast start doesn't apply, i.e. for reverse playback, when the whole file fits
+// in one buffer anyway, if the data doesn't start on a sample boundary, or if the sample rate
+// is so high that even two sectors don't give enough lead.
+UINT wav_first_sector_bytes(void)
+{
+  uint32_t lead;
+  UINT first;
+
+  if ((gReadMode != WAV_FORWARD) || (gChunkBytesRemaining <= BUFFER_SIZE) || (gFile.fptr & 1)) return 0;
+
+  lead = gWAVInfo.mSamplingRate * gWAVInfo.mBlockAlignment * WAV_FAST_START_LEAD_MS / 1000;
+  first = _MAX_SS - ((UINT)gFile.fptr & (_MAX_SS-1));
+  if (first < lead) first += _MAX_SS;
+  if ((first < lead) || (first >= BUFFER_SIZE)) return 0;
+
+  return first;
+}
+
 // vim: ts=2 sw=2 ai expandtab cindent
@@ -37,7 +37,10 @@ typedef struct {
 extern WAVInfo_t gWAVInfo;
 extern FIL gFile;
 extern uint8_t wav_open(const char *fname);
+extern uint8_t wav_reverse(void);
 extern uint8_t wav_fill_buffer(uint16_t *buf, UINT *bytesRead);
+extern uint8_t wav_read(uint8_t *buf, UINT len, UINT *bytesRead);
+extern UINT    wav_first_sector_bytes(void);
 
 #endif // _WAVREAD_H_
 // vim: ts=2 sw=2 ai expandtab cindent
@@ -26,22 +26,457 @@
 #include <string.h>
 #include <inttypes.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
 
 #include "config.h"
 #include "buffers.h"
 #include "wavread.h"
 #include "wavwrite.h"
 #include "ff.h"
+#include "diskio.h"
+#include "clmap.h"
 #include "fail.h"
+#include "timer.h"
+#include "adpcm.h"
+#include "pack12.h"
+#include "cue.h"
+#include "sdlat.h"
 
-// Create a WAV file, fill in basic info, then skip over the header
-// to get to the data. We have to seek back here to fill in the
+// In raw mode the WAV header is padded out to a whole sector with a JUNK chunk, so that audio
+// data starts on a sector boundary and every buffer is written as whole sectors.
+#define WAV_RAW_DATA_START 512
+#define WAV_HEADER_SIZE    44
+#define WAV_ADPCM_HEADER_SIZE 60 // 4 more bytes of fmt chunk plus a 'fact' chunk
+#define WAV_EXTENSIBLE_HEADER_SIZE 68 // 24 more bytes of fmt chunk
+
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+static uint8_t gCodec;          // WavCodec_t of the file being recorded
+static DWORD gDataStart;        // File offset of the first byte of audio data
+static DWORD gTrailerBytes;     // Chunks after the data chunk, counted in the RIFF size
+
+// Raw recording into a presized file: audio sectors are written straight to the card with
+// multi-block writes, bypassing FatFs. The FAT and directory entry are only brought up to
+// date in wav_rec_finalize().
+static uint8_t gRawRequested;   // Set by wav_set_raw(): use raw mode when the file allows it
+static uint8_t gRawMode;        // Raw mode is active for the file being recorded
+static DWORD gRawOffset;        // Raw mode: file offset of the next buffer to be written
+
+// Pre-erase of the presized area and per-burst write timing (in Stopwatch() ticks), so the
+// effect of pre-erase can be judged card by card. The bootloader's driver already sends ACMD23
+// ahead of each multi-block write, but only for that write's own sectors. Here the audio area is
+// erased further ahead, a bounded step at a time between buffer writes.
+#define WAV_ERASE_STEP  32U             // Most sectors erased per step
+#define WAV_ERASE_AHEAD 32768UL         // Keep this many bytes ahead of the next write erased
+#define WAV_ERASE_LONG_CS 50U           // Tick10ms count from which a step is timed by the 10ms tick
+
+static uint8_t gEraseRequested; // Set by wav_set_preerase(): erase ahead during raw recording
+static enum {
+  ERASE_OFF=0,                  // Not requested, or not a raw recording
+  ERASE_AHEAD,                  // Erasing ahead of the writes
+  ERASE_REFUSED,                // The card or the bootloader's driver won't erase
+} gEraseState;
+static DWORD gEraseNext;        // File offset of the first byte not yet erased
+static uint32_t gEraseCount;    // Erase steps issued
+static uint32_t gEraseTicks;    // Total time spent erasing. Stopwatch() wraps after 524ms, so
+                                // steps of 0.5s or more are timed by the 10ms tick instead.
+static uint32_t gBurstCount;    // Writes issued
+static uint32_t gBurstTicks;    // Total time spent writing
+static uint16_t gBurstMax;      // Longest single write, i.e., the longest the main loop stalls
+
+// Black box recording: a raw recording that reaches the end of its presized file carries on at
+// the start of the audio area again, so the file always holds the latest audio. The header
+// takes up the whole first cluster so the audio is made of whole clusters, and when recording
+// stops the FAT chain is relinked to put the oldest of them first. Nothing is copied.
+static uint8_t gRingRequested;  // Set by wav_set_ring()
+static uint8_t gRingMode;       // The raw recording in progress is a ring
+static uint8_t gRingWrapped;    // The ring has been gone around at least once
+static DWORD gRingEnd;          // File offset of the end of the ring
+
+// A ring cut off by a power failure is unrolled by wav_repair(), from a record at the start of
+// the JUNK chunk that checkpoints keep up to date: "RING", then the file offset up to which the
+// audio is good (gRingMark), how many bytes after it may have been written over since, and
+// whether the ring had wrapped, all 32-bit. A checkpoint is due every WAV_RING_MARK_BYTES/2.
+#define WAV_RING_RECORD_SIZE 16
+#define WAV_RING_MARK_BYTES  65536UL
+static DWORD gRingMark;         // Audio before this file offset was written by the last checkpoint
+static uint8_t gRingMarkWrapped;// The ring had wrapped as of the last checkpoint
+static DWORD gRingRecord;       // File offset of the record
+
+// Periodic header refresh so a recording cut short by a power failure or reset is still a valid
+// WAV file up to the last refresh. The name of the file being recorded is kept in EEPROM until
+// it is finalized, so wav_repair() knows which file to fix up next time the card is mounted.
+static uint32_t gCheckpointBytes;       // Refresh header after this many bytes of audio, 0 if off
+static uint32_t gBytesSinceCheckpoint;
+static uint16_t gCheckpointSeconds;     // Set by wav_set_checkpoint()
+static char EEMEM gRepairName[13];      // 8.3 name of the recording in progress, 0 or 0xFF if none
+
+// Rotation of long recordings into numbered files (REC0001.WAV, REC0002.WAV, ...) at a time or
+// size limit. While one file is recorded the next one is created, and its clusters allocated a
+// step at a time, in idle time. The switch happens between two writes so no audio is lost, and
+// the previous file is finalized in idle time afterwards. Raw mode and ADPCM recordings don't
+// rotate: the former needs a presized file, the latter has blocks that straddle writes.
+//
+// An allocate step adds a cluster at a time for up to WAV_ROTATE_ALLOC_TICKS. Idle steps start
+// when the writes have caught up with DMA, which then has at least BUFFER_SIZE bytes to fill
+// before audio is lost, 4.6ms at the fastest ADC rate (adcplan.h). A step ends well within that:
+// 1ms plus the last cluster, which costs a FAT sector read and write at most, unless a
+// fragmented card makes FatFs search further for a free cluster. The file position at the start
+// of the audio data is kept from when the header was written and put back at the end, since
+// seeking back would walk the whole new cluster chain.
+//
+// gSpareFile, which graceful degradation below shares, is always there: sizeof(FIL) is 32 bytes
+// of SRAM, and the kept position another 8.
+#define WAV_ROTATE_ALLOC_TICKS 125U     // Stopwatch() ticks (1ms) an allocate step may go on for
+static uint32_t gRotateSeconds;         // Set by wav_set_rotate_seconds(), 0 for no time limit
+static uint16_t gRotateMegabytes;       // Set by wav_set_rotate_megabytes(), 0 for no size limit
+static DWORD gRotateBytes;              // Audio bytes per file for the current recording
+static char gRotateBase[5];             // File names are this plus a 4-digit number
+static uint16_t gRotateNumber;          // Number of the file being recorded
+static FIL gSpareFile;                  // The next file while it is prepared, then the previous one
+static DWORD gSpareClust;               // gSpareFile's cluster and sector at the start of the audio
+static DWORD gSpareSect;
+static DWORD gSpareDataBytes;           // Audio bytes in the previous file
+static enum {
+  ROTATE_OFF,       // Not rotating
+  ROTATE_CREATE,    // Next file is to be created
+  ROTATE_ALLOCATE,  // Next file is being extended to its full size
+  ROTATE_READY,     // Next file is ready to switch to
+  ROTATE_FINALIZE,  // Previous file is to be finalized
+} gRotateState;
+
+// Graceful degradation: when the card cannot keep up with a PCM recording, the rest of it goes
+// to a second file in a cheaper encoding. That file (NAMED.WAV for NAME.WAV, the base name cut
+// to 7 characters) is created with its header when recording starts, so the switch between two
+// writes takes no card access. The PCM file is finalized in idle time afterwards, which the
+// cheaper encoding makes room for. Uses gSpareFile, so rotating recordings don't degrade.
+static char gDegradeName[13];           // Name of the second file
+static uint8_t gDegradeCodec;           // WavCodec_t of the second file
+static enum {
+  DEGRADE_OFF,        // No second file
+  DEGRADE_ARMED,      // Second file is ready to switch to
+  DEGRADE_FINALIZE,   // Switched, the PCM file is to be finalized
+  DEGRADE_DONE,       // Switched, the PCM file is finalized
+} gDegradeState;
+
+void wav_set_raw(uint8_t enable)
+{
+  gRawRequested = enable;
+}
+
+// Raw mode may be used for the next recording, so it must be written in whole sectors
+uint8_t wav_raw_requested(void)
+{
+  return gRawRequested;
+}
+
+void wav_set_preerase(uint8_t enable)
+{
+  gEraseRequested = enable;
+}
+
+void wav_set_ring(uint8_t enable)
+{
+  gRingRequested = enable;
+}
+
+void wav_get_write_stats(uint8_t *erased, uint32_t *count, uint32_t *ticks, uint16_t *max)
+{
+  *erased = gEraseState;
+  *count = gBurstCount;
+  *ticks = gBurstTicks;
+  *max = gBurstMax;
+}
+
+void wav_get_erase_stats(uint32_t *count, uint32_t *ticks)
+{
+  *count = gEraseCount;
+  *ticks = gEraseTicks;
+}
+
+void wav_set_checkpoint(uint16_t seconds)
+{
+  gCheckpointSeconds = seconds;
+}
+
+void wav_set_rotate_seconds(uint32_t seconds)
+{
+  gRotateSeconds = seconds;
+}
+
+void wav_set_rotate_megabytes(uint16_t megabytes)
+{
+  gRotateMegabytes = megabytes;
+}
+
+static void _rotate_name(char *name, uint16_t number)
+{
+  char *p;
+  uint8_t i;
+
+  strcpy(name, gRotateBase);
+  p = name + strlen(name) + 4;
+  strcpy_P(p, PSTR(".WAV"));
+  for (i=0; i < 4; i++) {
+    *--p = '0' + number % 10;
+    number /= 10;
+  }
+}
+
+static void _set_repair_name(const char *fname)
+{
+  if (fname) {
+    eeprom_update_block(fname, gRepairName, sizeof(gRepairName));
+  } else {
+    eeprom_update_byte((uint8_t *)gRepairName, 0);
+  }
+}
+
+// Bytes after gRingMark that may have been written over since the last checkpoint: the mark is
+// rounded down to a cluster and a checkpoint may be up to WAV_RING_MARK_BYTES/2 late
+static DWORD _ring_drop(void)
+{
+  DWORD clustBytes = gFile.fs->csize * 512UL;
+
+  return (WAV_RING_MARK_BYTES + clustBytes - 1) / clustBytes * clustBytes + clustBytes;
+}
+
+// The ring record, all zeros if the file isn't a ring being recorded
+static void _ring_record(uint8_t *rec)
+{
+  memset(rec, 0, WAV_RING_RECORD_SIZE);
+  if (gRingMode) {
+    memcpy_P(rec, PSTR("RING"), 4);
+    *(uint32_t *)(rec+4) = gRingMark;
+    *(uint32_t *)(rec+8) = _ring_drop();
+    rec[12] = gRingMarkWrapped;
+  }
+}
+
+// Number of bytes of audio data written so far
+static DWORD _data_bytes(void)
+{
+  return (gRawMode ? gRawOffset : f_tell(&gFile)) - gDataStart;
+}
+
+// Write the header at the start of a file for 'dataBytes' of audio data, leaving the file
+// pointer at the first byte of audio data. In raw mode only the chunk header of the JUNK
+// chunk is written, not its contents.
+// Returns 0 if failure, 1 if successful.
+static uint8_t _put_header(FIL *fp, DWORD dataBytes)
+{
+  FRESULT fresult;
+  UINT bytesWritten;
+  uint8_t buf[24];
+
+  fresult = f_lseek(fp, 0);
+  if (fresult != FR_OK) return fail_minor(FAIL_WAV_SEEK);
+
+  memcpy_P(buf, PSTR("RIFF    WAVEfmt \x10\x00\x00\x00\x01\x00"), 22);
+  *(uint32_t *)(buf+4) = dataBytes + gDataStart + gTrailerBytes - 8;
+#if WITH_ADPCM==1
+  if (gCodec == WAV_CODEC_ADPCM) {
+    buf[16] = 20; // fmt chunk has cbSize and wSamplesPerBlock too
+    buf[20] = WAVE_FORMAT_IMA_ADPCM;
+  }
+#endif
+#if WITH_PACK12==1
+  if (gCodec == WAV_CODEC_PACKED12) {
+    *(uint16_t *)(buf+20) = WAVE_FORMAT_PACKED12;
+  }
+#endif
+  if (gWAVInfo.mChannels > 2) {
+    buf[16] = 40; // fmt chunk has cbSize and the extension too
+    *(uint16_t *)(buf+20) = WAVE_FORMAT_EXTENSIBLE;
+  }
+
+  fresult = f_write(fp, buf, 22, &bytesWritten);
+  if ((fresult != FR_OK) || (bytesWritten != 22)) return fail_minor(FAIL_WAV_NO_HEADER);
+
+  // Now write out WAVINFO header
+  fresult = f_write(fp, &gWAVInfo, 14, &bytesWritten);
+  if ((fresult != FR_OK) || (bytesWritten != 14)) return fail_minor(FAIL_WAV_NO_HEADER);
+
+  // WAVE_FORMAT_EXTENSIBLE: cbSize, all 16 bits valid, no speaker positions, and the PCM
+  // subformat GUID 00000001-0000-0010-8000-00AA00389B71
+  if (gWAVInfo.mChannels > 2) {
+    memcpy_P(buf, PSTR("\x16\x00\x10\x00\x00\x00\x00\x00"
+                       "\x01\x00\x00\x00\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71"), 24);
+
+    fresult = f_write(fp, buf, 24, &bytesWritten);
+    if ((fresult != FR_OK) || (bytesWritten != 24)) return fail_minor(FAIL_WAV_NO_HEADER);
+  }
+
+#if WITH_ADPCM==1
+  // ADPCM: rest of the fmt chunk, then a 'fact' chunk with the number of sample frames
+  if (gCodec == WAV_CODEC_ADPCM) {
+    *(uint16_t *)(buf+0) = 2;
+    *(uint16_t *)(buf+2) = ADPCM_FRAMES_PER_BLOCK;
+    memcpy_P(buf+4, PSTR("fact\x04\x00\x00\x00"), 8);
+    *(uint32_t *)(buf+12) = adpcm_frames();
+
+    fresult = f_write(fp, buf, 16, &bytesWritten);
+    if ((fresult != FR_OK) || (bytesWritten != 16)) return fail_minor(FAIL_WAV_NO_HEADER);
+  }
+#endif
+
+  // Raw mode: a JUNK chunk pads the header out to the first audio sector (cluster for a ring)
+  if (gRawMode) {
+    memcpy_P(buf, PSTR("JUNK"), 4);
+    *(uint32_t *)(buf+4) = gDataStart - f_tell(fp) - 16; // Up to the data chunk header
+
+    fresult = f_write(fp, buf, 8, &bytesWritten);
+    if ((fresult != FR_OK) || (bytesWritten != 8)) return fail_minor(FAIL_WAV_NO_HEADER);
+
+    gRingRecord = f_tell(fp);
+    _ring_record(buf);
+    fresult = f_write(fp, buf, WAV_RING_RECORD_SIZE, &bytesWritten);
+    if ((fresult != FR_OK) || (bytesWritten != WAV_RING_RECORD_SIZE)) return fail_minor(FAIL_WAV_NO_HEADER);
+
+    fresult = f_lseek(fp, gDataStart-8);
+    if (fresult != FR_OK) return fail_minor(FAIL_WAV_SEEK);
+  }
+
+  // Finally write out last 8 bytes of header, "data" plus subchunk2 size
+  memcpy_P(buf, PSTR("data    "), 8);
+  *(uint32_t *)(buf+4) = dataBytes;
+
+  fresult = f_write(fp, buf, 8, &bytesWritten);
+  if ((fresult != FR_OK) || (bytesWritten != 8)) return fail_minor(FAIL_WAV_NO_HEADER);
+
+  return 1;
+}
+
+// _put_header(), timed as one write
+static uint8_t _write_header(FIL *fp, DWORD dataBytes)
+{
+  uint8_t ok;
+
+  sdlat_begin();
+  ok = _put_header(fp, dataBytes);
+  sdlat_end();
+  return ok;
+}
+
+// Pre-erase: erase up to WAV_ERASE_STEP sectors of the audio area, within one fragment, if
+// the next write is less than WAV_ERASE_AHEAD bytes away from the erased part, so the card
+// doesn't erase as it goes when the recording gets there. Called between buffer writes. A ring
+// is only erased ahead on its first pass, so the audio already in it is kept.
+void wav_preerase_step(void)
+{
+  DWORD range[2];
+  DWORD contig;
+  uint16_t start, startCs, cs;
+
+  if ((gEraseState != ERASE_AHEAD) || (gEraseNext >= f_size(&gFile))
+      || (gEraseNext >= gRawOffset + WAV_ERASE_AHEAD)) return;
+
+  range[0] = clmap_sector(gEraseNext, &contig);
+  if (contig > WAV_ERASE_STEP) contig = WAV_ERASE_STEP;
+  range[1] = range[0] + contig - 1;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    startCs = Tick10ms;
+  }
+  start = Stopwatch();
+  if (disk_ioctl(gFile.fs->drv, CTRL_ERASE_SECTOR, range) != RES_OK) {
+    gEraseState = ERASE_REFUSED;
+    return;
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    cs = Tick10ms - startCs;
+  }
+  if (cs >= WAV_ERASE_LONG_CS) {
+    gEraseTicks += (uint32_t)cs * (10000U/STOPWATCH_US_PER_TICK);
+  } else {
+    gEraseTicks += (uint16_t)(Stopwatch() - start);
+  }
+  gEraseCount++;
+  gEraseNext += contig*512UL;
+}
+
+// Set up a ring of whole clusters after the header cluster. Clusters must hold whole buffers
+// and there must be at least two of them. The file is cut back to the end of the last whole
+// cluster so that relinking leaves no cluster behind.
+static uint8_t _open_ring(void)
+{
+  DWORD clustBytes = gFile.fs->csize * 512UL;
+
+  gRingEnd = f_size(&gFile) - f_size(&gFile) % clustBytes;
+  if ((clustBytes < BUFFER_SIZE) || (gRingEnd < 3*clustBytes)
+      || (f_lseek(&gFile, gRingEnd) != FR_OK) || (f_truncate(&gFile) != FR_OK)
+      || (f_lseek(&gFile, 0) != FR_OK)) {
+    return 0;
+  }
+  gRawOffset = clustBytes;
+  return 1;
+}
+
+// Try to open a presized file for raw recording. It must have room for the header sector and
+// at least one buffer, and be mapped by the cluster map. Returns 0 (with the file closed) if not.
+static uint8_t _open_raw(const char *fname)
+{
+  if (f_open(&gFile, fname, FA_WRITE | FA_OPEN_EXISTING) != FR_OK) return 0;
+
+  gRawOffset = WAV_RAW_DATA_START;
+  gRingMode = gRingRequested;
+  gRingWrapped = 0;
+  if ((f_size(&gFile) >= WAV_RAW_DATA_START + BUFFER_SIZE) && (! gRingMode || _open_ring())
+      && clmap_build(&gFile)) {
+    if (gEraseRequested) {
+      gEraseState = ERASE_AHEAD;
+      gEraseNext = gRawOffset;
+    }
+    return 1;
+  }
+
+  (void) f_close(&gFile);
+  return 0;
+}
+
+// Fill in the rest of the WAVINFO header, and where the audio data starts, for recording in
+// 'codec' with the channels and sampling rate already in it
+static void _set_format(WavCodec_t codec)
+{
+  uint8_t channels = gWAVInfo.mChannels;
+  uint16_t Fs = gWAVInfo.mSamplingRate;
+
+  gCodec = codec;
+  gDataStart = WAV_HEADER_SIZE;
+  gWAVInfo.mBytesPerSecond = (uint32_t)Fs*channels*2;
+  gWAVInfo.mBlockAlignment = channels*2;
+  gWAVInfo.mBitsPerSample  = 16;
+
+  // More than two channels need WAVE_FORMAT_EXTENSIBLE
+  if (channels > 2) gDataStart = WAV_EXTENSIBLE_HEADER_SIZE;
+
+#if WITH_ADPCM==1
+  if (codec == WAV_CODEC_ADPCM) {
+    gWAVInfo.mBlockAlignment = ADPCM_BLOCK_ALIGN(channels);
+    gWAVInfo.mBytesPerSecond = (uint32_t)Fs * ADPCM_BLOCK_ALIGN(channels) / ADPCM_FRAMES_PER_BLOCK;
+    gWAVInfo.mBitsPerSample  = 4;
+    gDataStart = WAV_ADPCM_HEADER_SIZE;
+  }
+#endif
+#if WITH_PACK12==1
+  if (codec == WAV_CODEC_PACKED12) {
+    gWAVInfo.mBlockAlignment = 3*channels; // Two sample frames per block
+    gWAVInfo.mBytesPerSecond = (uint32_t)Fs*channels*3/2;
+    gWAVInfo.mBitsPerSample  = 12;
+  }
+#endif
+}
+
+// Create a WAV file, fill in basic info, then write a header for an empty
+// data chunk to get to the data. We have to seek back here to fill in the
 // data size when all is said and done.
 // Returns 0 if failure, 1 if successful.
 // NOTE: It uses one of the global ping-pong buffers for temporary storage
-uint8_t wav_create(const char *fname, uint8_t stereo, uint16_t Fs)
+uint8_t wav_create(const char *fname, uint8_t channels, uint16_t Fs, WavCodec_t codec)
 {
   FRESULT fresult;
+  char name[13];
 
   (void) fail_major(FAIL_WAV_CREATE);
 
@@ -59,74 +494,625 @@ uint8_t wav_create(const char *fname, uint8_t stereo, uint16_t Fs)
   }
 #endif
 
-  fresult = f_open(&gFile, fname, FA_WRITE | FA_CREATE_ALWAYS);
-  if (fresult != FR_OK) return fail_minor(FAIL_WAV_NO_FILE);
+  gEraseState = ERASE_OFF;
+  gEraseCount = gEraseTicks = 0;
+  gBurstCount = gBurstTicks = gBurstMax = 0;
+  gDegradeState = DEGRADE_OFF;
 
-  // Skip over the first 44 bytes, all the header/chunk stuff
-  fresult = f_lseek(&gFile, 44);
-  if (fresult != FR_OK) return fail_minor(FAIL_WAV_SEEK);
+  gRotateState = ROTATE_OFF;
+  if ((gRotateSeconds || gRotateMegabytes) && (codec != WAV_CODEC_ADPCM)) {
+    uint8_t i;
 
-  // All ready to start writing data. When done, we'll have to go back and fill in the header.
-  // For now, fill in the WAVINFO header so we know how to finalize.
-  stereo = stereo ? 2 : 1;
-  gWAVInfo.mChannels       = stereo;
+    for (i=0; (i < 4) && fname[i] && (fname[i] != '.'); i++) gRotateBase[i] = fname[i];
+    gRotateBase[i] = 0;
+    gRotateNumber = 1;
+    _rotate_name(name, gRotateNumber);
+    fname = name;
+    gRotateState = ROTATE_CREATE;
+  }
+
+  // Raw mode needs whole sectors, which only uncompressed recording produces
+  gRawMode = gRawRequested && (gRotateState == ROTATE_OFF) && (codec == WAV_CODEC_PCM) && _open_raw(fname);
+  if (! gRawMode) {
+    fresult = f_open(&gFile, fname, FA_WRITE | FA_CREATE_ALWAYS);
+    if (fresult != FR_OK) return fail_minor(FAIL_WAV_NO_FILE);
+  }
+
+  // Fill in the WAVINFO header so we know how to finalize.
+  gWAVInfo.mChannels       = channels;
   gWAVInfo.mSamplingRate   = Fs;
-  gWAVInfo.mBytesPerSecond = Fs*stereo*2;
-  gWAVInfo.mBlockAlignment = stereo*2;
-  gWAVInfo.mBitsPerSample  = 16;
+  _set_format(codec);
+#if WITH_ADPCM==1
+  if (codec == WAV_CODEC_ADPCM) adpcm_begin(channels);
+#endif
+
+  // Raw mode: clear the header sector so the JUNK chunk is all zeros (in its first sector)
+  if (gRawMode) {
+    UINT bytesWritten;
+
+    gDataStart = gRawOffset;
+    gRingMark = gDataStart;
+    gRingMarkWrapped = 0;
+    memset((uint8_t *)gBuffers, 0, WAV_RAW_DATA_START);
+    sdlat_begin();
+    fresult = f_write(&gFile, (const uint8_t *)gBuffers, WAV_RAW_DATA_START, &bytesWritten);
+    sdlat_end();
+    if ((fresult != FR_OK) || (bytesWritten != WAV_RAW_DATA_START)) return fail_minor(FAIL_WAV_NO_HEADER);
+  }
+
+  // All ready to start writing data, once there is a header for an empty data chunk.
+  // When done, we'll have to go back and fill in the size.
+  if (! _write_header(&gFile, 0)) return 0;
+
+  // Limit each file to what FAT allows, and to the rotation time and size
+  gRotateBytes = 0xFFFFFFFFUL - gDataStart;
+  if (gRotateSeconds && (gRotateSeconds < gRotateBytes / gWAVInfo.mBytesPerSecond)) {
+    gRotateBytes = gRotateSeconds * gWAVInfo.mBytesPerSecond;
+  }
+  if (gRotateMegabytes && (gRotateMegabytes < 4096) && ((DWORD)gRotateMegabytes*1048576UL < gRotateBytes)) {
+    gRotateBytes = (DWORD)gRotateMegabytes*1048576UL;
+  }
+
+  // A ring is only a valid WAV file once it has been relinked, so its checkpoints only keep the
+  // ring record up to date
+  gBytesSinceCheckpoint = 0;
+  gCheckpointBytes = (gRawMode && gRingMode) ? WAV_RING_MARK_BYTES/2 : (uint32_t)gCheckpointSeconds * gWAVInfo.mBytesPerSecond;
+  if (gCheckpointBytes) {
+    _set_repair_name(fname);
+    sdlat_begin();
+    fresult = f_sync(&gFile);
+    sdlat_end();
+    if (fresult != FR_OK) return fail_minor(FAIL_WAV_NO_HEADER);
+  }
 
   return fail_nofail();
 }
 
-uint8_t wav_rec_finalize(void)
+static uint8_t _write(const uint8_t *buf, UINT len)
 {
   FRESULT fresult;
   UINT bytesWritten;
-  DWORD subChunk2Size;
-  uint8_t *buf = (uint8_t *)gBuffers;
+  DWORD sect, contig;
+  uint8_t left, count;
+
+  if (! gRawMode) {
+    sdlat_begin();
+    fresult = f_write(&gFile, buf, len, &bytesWritten);
+    sdlat_end();
+    if ((fresult != FR_OK) || (bytesWritten != len)) return fail(FAIL_REC, FAIL_REC_BUFWRITE);
+    return 1;
+  }
+
+  if (gRingMode && (gRawOffset + len > gRingEnd)) {
+    gRawOffset = gDataStart;
+    gRingWrapped = 1;
+  }
+  if (gRawOffset + len > f_size(&gFile)) return fail(FAIL_REC, FAIL_REC_FULL);
+
+  // Normally a single (multi-block) write, unless the data straddles two fragments
+  for (left = len/512; left; left -= count) {
+    sect = clmap_sector(gRawOffset, &contig);
+    count = (contig < left) ? (uint8_t)contig : left;
+    sdlat_begin();
+    fresult = (disk_write(gFile.fs->drv, buf, sect, count) == RES_OK) ? FR_OK : FR_DISK_ERR;
+    sdlat_end();
+    if (fresult != FR_OK) return fail(FAIL_REC, FAIL_REC_BUFWRITE);
+
+    buf += count*512U;
+    gRawOffset += count*512U;
+  }
+  return 1;
+}
+
+// Carry on recording into the next file, which has been prepared, and leave the current one
+// to be finalized
+static void _rotate_switch(void)
+{
+  FIL prev = gFile;
+
+  gSpareDataBytes = _data_bytes();
+  gFile = gSpareFile;
+  gSpareFile = prev;
+  gRotateNumber++;
+  gRotateState = ROTATE_FINALIZE;
+  gBytesSinceCheckpoint = 0;
+}
+
+// Finalize the previous file: its file pointer is still at the end of its audio data
+static uint8_t _rotate_finalize_prev(void)
+{
+  char name[13];
+
+  if (f_truncate(&gSpareFile) != FR_OK) return fail_minor(FAIL_WAV_TRUNCATE);
+  if (! _write_header(&gSpareFile, gSpareDataBytes)) return 0;
+  if (f_close(&gSpareFile) != FR_OK) return fail_minor(FAIL_WAV_NO_HEADER);
+
+  // From now on it is the current file that wav_repair() should fix up if need be
+  if (gCheckpointBytes) {
+    _rotate_name(name, gRotateNumber);
+    _set_repair_name(name);
+  }
+  return 1;
+}
+
+// One step of file rotation (see wav_rotate_step())
+static uint8_t _rotate_step(void)
+{
+  char name[13];
+  DWORD size, clustBytes;
+  uint16_t start;
+
+  switch (gRotateState) {
+    case ROTATE_CREATE:
+      _rotate_name(name, gRotateNumber+1);
+      if (f_open(&gSpareFile, name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) return fail(FAIL_REC, FAIL_WAV_NO_FILE);
+      if (! _write_header(&gSpareFile, 0)) return fail_major(FAIL_REC);
+      gSpareClust = gSpareFile.clust;
+      gSpareSect = gSpareFile.dsect;
+      gRotateState = ROTATE_ALLOCATE;
+      break;
+
+    case ROTATE_ALLOCATE:
+      // Seeking a cluster past the end allocates one, carrying on from the current cluster.
+      // Should the card fill up, the file just ends up shorter and gets extended by writing once
+      // it is recorded to.
+      clustBytes = gSpareFile.fs->csize * 512UL;
+      start = Stopwatch();
+      do {
+        size = f_size(&gSpareFile);
+        if (size - gDataStart >= gRotateBytes) break;
+        size = (gRotateBytes - (size - gDataStart) > clustBytes) ? size + clustBytes : gDataStart + gRotateBytes;
+        if (f_lseek(&gSpareFile, size) != FR_OK) return fail(FAIL_REC, FAIL_WAV_SEEK);
+        if (f_tell(&gSpareFile) != size) break;
+        if ((uint16_t)(Stopwatch() - start) >= WAV_ROTATE_ALLOC_TICKS) return 1;
+      } while (1);
+
+      gSpareFile.fptr = gDataStart;
+      gSpareFile.clust = gSpareClust;
+      gSpareFile.dsect = gSpareSect;
+      gRotateState = ROTATE_READY;
+      break;
+
+    case ROTATE_FINALIZE:
+      if (! _rotate_finalize_prev()) return fail_major(FAIL_REC);
+      gRotateState = ROTATE_CREATE;
+      break;
+
+    default:
+      break;
+  }
+  return 1;
+}
+
+// Do the next step of file rotation, if any, in idle time.
+// Returns 0 if failure, 1 if successful.
+uint8_t wav_rotate_step(void)
+{
+  uint8_t ok;
+
+  if ((gRotateState == ROTATE_OFF) || (gRotateState == ROTATE_READY)) return 1;
+
+  sdlat_begin();
+  ok = _rotate_step();
+  sdlat_end();
+  return ok;
+}
+
+// Finish off rotation when recording stops: finalize the previous file if that hasn't happened
+// yet, or throw away the next one if it has been created
+static void _rotate_end(void)
+{
+  char name[13];
+
+  switch (gRotateState) {
+    case ROTATE_ALLOCATE:
+    case ROTATE_READY:
+      (void) f_close(&gSpareFile);
+      _rotate_name(name, gRotateNumber+1);
+      (void) f_unlink(name);
+      break;
+
+    case ROTATE_FINALIZE:
+      (void) _rotate_finalize_prev();
+      break;
+
+    default:
+      break;
+  }
+  gRotateState = ROTATE_OFF;
+}
+
+// Create the second file for graceful degradation of the PCM recording just created with
+// wav_create(), with a header for audio in 'codec'. Returns 0 (setting no fail code, as the
+// recording goes ahead regardless) if the recording can't degrade or the file can't be made.
+uint8_t wav_degrade_prepare(const char *fname, WavCodec_t codec)
+{
+  uint8_t i, ok;
+
+  if ((codec == WAV_CODEC_PCM) || (gCodec != WAV_CODEC_PCM) || gRawMode
+      || (gRotateState != ROTATE_OFF) || (gWAVInfo.mChannels > 2)) {
+    return 0;
+  }
+
+  for (i=0; (i < 7) && fname[i] && (fname[i] != '.'); i++) gDegradeName[i] = fname[i];
+  if ((i == 7) && ((fname[7] | 0x20) == 'd')) return 0; // Would be the same name
+  strcpy_P(gDegradeName+i, PSTR("D.WAV"));
+  if (f_open(&gSpareFile, gDegradeName, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) return 0;
+
+  _set_format(codec);
+  ok = _write_header(&gSpareFile, 0);
+  _set_format(WAV_CODEC_PCM);
+  if (! ok) {
+    (void) f_close(&gSpareFile);
+    (void) f_unlink(gDegradeName);
+    return 0;
+  }
+
+  gDegradeCodec = codec;
+  gDegradeState = DEGRADE_ARMED;
+  return 1;
+}
+
+// Carry on recording into the second file, in its encoding, and leave the PCM file to be
+// finalized. Returns the new WavCodec_t, or WAV_CODEC_PCM if there is no second file. The
+// recording goes on, but the switch is recorded as a FAIL_REC_DEGRADED fail code, which
+// wav_rec_finalize() puts back once the recording has been stopped.
+WavCodec_t wav_degrade(void)
+{
+  FIL prev = gFile;
+
+  if (gDegradeState != DEGRADE_ARMED) return WAV_CODEC_PCM;
+
+  (void) fail(FAIL_REC, FAIL_REC_DEGRADED);
+  gSpareDataBytes = _data_bytes();
+  gFile = gSpareFile;
+  gSpareFile = prev;
+  _set_format(gDegradeCodec);
+#if WITH_ADPCM==1
+  if (gCodec == WAV_CODEC_ADPCM) adpcm_begin(gWAVInfo.mChannels);
+#endif
+  gBytesSinceCheckpoint = 0;
+  gCheckpointBytes = (uint32_t)gCheckpointSeconds * gWAVInfo.mBytesPerSecond;
+  gDegradeState = DEGRADE_FINALIZE;
+  return gCodec;
+}
+
+// Finalize the PCM file after a switch: its file pointer is still at the end of its audio data
+static void _degrade_finalize_prev(void)
+{
+  uint8_t codec = gCodec;
+
+  sdlat_begin();
+  _set_format(WAV_CODEC_PCM);
+  if (! _write_header(&gSpareFile, gSpareDataBytes) || (f_close(&gSpareFile) != FR_OK)) {
+    (void) fail(FAIL_REC, FAIL_WAV_NO_HEADER);
+  }
+  _set_format(codec);
+  sdlat_end();
+  gDegradeState = DEGRADE_DONE;
+
+  // From now on it is the second file that wav_repair() should fix up if need be
+  if (gCheckpointBytes) _set_repair_name(gDegradeName);
+}
+
+// Finalize the PCM file in idle time after a switch. A failure there doesn't stop the
+// recording, which carries on in the second file.
+void wav_degrade_step(void)
+{
+  if (gDegradeState == DEGRADE_FINALIZE) _degrade_finalize_prev();
+}
+
+// When recording stops: throw away the second file if it was never switched to, or finalize
+// the PCM file if that hasn't happened yet
+static void _degrade_end(void)
+{
+  switch (gDegradeState) {
+    case DEGRADE_ARMED:
+      (void) f_close(&gSpareFile);
+      (void) f_unlink(gDegradeName);
+      break;
+
+    case DEGRADE_FINALIZE:
+      _degrade_finalize_prev();
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Write audio data. In raw mode 'len' must be a multiple of 512.
+// Returns 0 if failure, 1 if successful.
+uint8_t wav_write(const uint8_t *buf, UINT len)
+{
+  uint16_t start = Stopwatch();
+  uint16_t ticks;
+
+  if ((gRotateState == ROTATE_READY) && (_data_bytes() + len > gRotateBytes)) _rotate_switch();
+
+  if (! _write(buf, len)) return 0;
+
+  gBytesSinceCheckpoint += len;
+
+  ticks = Stopwatch() - start;
+  gBurstCount++;
+  gBurstTicks += ticks;
+  if (ticks > gBurstMax) gBurstMax = ticks;
+  return 1;
+}
+
+// Non-zero if the header should be refreshed
+uint8_t wav_checkpoint_due(void)
+{
+  return gCheckpointBytes && (gBytesSinceCheckpoint >= gCheckpointBytes);
+}
+
+// Ring checkpoint: move the mark up to the cluster being written and update the ring record
+static uint8_t _ring_checkpoint(void)
+{
+  DWORD clustBytes = gFile.fs->csize * 512UL;
+  UINT bytesWritten;
+  uint8_t rec[WAV_RING_RECORD_SIZE];
+
+  gRingMark = gRawOffset - (gRawOffset - gDataStart) % clustBytes;
+  gRingMarkWrapped = gRingWrapped;
+  if (gRingMark == gRingEnd) { // All the way round, the next write wraps
+    gRingMark = gDataStart;
+    gRingMarkWrapped = 1;
+  }
+
+  _ring_record(rec);
+  if ((f_lseek(&gFile, gRingRecord) != FR_OK)
+      || (f_write(&gFile, rec, WAV_RING_RECORD_SIZE, &bytesWritten) != FR_OK)
+      || (bytesWritten != WAV_RING_RECORD_SIZE) || (f_sync(&gFile) != FR_OK)) {
+    return fail(FAIL_REC, FAIL_REC_CHECKPOINT);
+  }
+  return 1;
+}
+
+// Bring the header and directory entry up to date with the audio written so far, so the file
+// is valid up to this point should recording never be finalized.
+// Returns 0 if failure, 1 if successful.
+static uint8_t _checkpoint(void)
+{
+  DWORD fptr = gFile.fptr;
+  DWORD clust = gFile.clust;
+  DWORD dsect = gFile.dsect;
+
+  if (gRawMode && gRingMode) return _ring_checkpoint();
+
+  if (! _write_header(&gFile, _data_bytes())) return fail_major(FAIL_REC);
+
+  // Put the file pointer back where it was. f_lseek() would walk the cluster chain from the
+  // start of the file (no fast seek), which takes longer the longer the recording gets. The
+  // file hasn't been resized, so its position fields are still good. Raw mode doesn't use them.
+  gFile.fptr = fptr;
+  gFile.clust = clust;
+  gFile.dsect = dsect;
+
+  if (f_sync(&gFile) != FR_OK) return fail(FAIL_REC, FAIL_REC_CHECKPOINT);
+
+  return 1;
+}
+
+// Bring the file up to date (see above), timed as one write.
+// Returns 0 if failure, 1 if successful.
+uint8_t wav_checkpoint(void)
+{
+  uint8_t ok;
+
+  gBytesSinceCheckpoint = 0;
+
+  sdlat_begin();
+  ok = _checkpoint();
+  sdlat_end();
+  return ok;
+}
+
+// Relink the clusters of a ring that has been gone around so that the file starts with the
+// oldest whole cluster and ends with the newest audio. The stale end of the cluster with the
+// newest audio is cut off. Leaves gRawOffset at the new end of the audio data.
+// Returns 0 if failure, 1 if successful.
+static uint8_t _ring_unroll(void)
+{
+  DWORD clustBytes = gFile.fs->csize * 512UL;
+  DWORD count = (gRingEnd - gDataStart) / clustBytes;       // Clusters in the ring
+  DWORD newest = (gRawOffset - gDataStart - 1) / clustBytes; // Ring cluster written last
+  DWORD oldest = (newest+1 == count) ? 0 : newest+1;
+  DWORD eoc = (gFile.fs->fs_type == FS_FAT32) ? 0x0FFFFFFFUL : 0xFFFFUL;
+  DWORD first, last, end;
+
+  if (oldest) {
+    // The window must be clean before the FAT can be changed behind FatFs' back
+    if (f_sync(&gFile) != FR_OK) return fail_minor(FAIL_WAV_RELINK);
+
+    first = clmap_cluster(gDataStart);
+    last = clmap_cluster(gRingEnd - clustBytes);
+    end = clmap_cluster(gDataStart + newest*clustBytes);
+    if (! clmap_set_fat(gFile.sclust, clmap_cluster(gDataStart + oldest*clustBytes))
+        || ! clmap_set_fat(last, first) || ! clmap_set_fat(end, eoc)) {
+      return fail_minor(FAIL_WAV_RELINK);
+    }
+  }
+
+  // Back to the start so FatFs follows the new chain from the first cluster
+  if (f_lseek(&gFile, 0) != FR_OK) return fail_minor(FAIL_WAV_SEEK);
+
+  gRawOffset += (count-1-newest) * clustBytes;
+  return 1;
+}
+
+// Write a 32-bit value at a file offset. Returns 0 if failure, 1 if successful.
+static uint8_t _repair_write(DWORD ofs, uint32_t value)
+{
+  UINT bytesWritten;
+
+  return (f_lseek(&gFile, ofs) == FR_OK) && (f_write(&gFile, &value, 4, &bytesWritten) == FR_OK)
+         && (bytesWritten == 4);
+}
+
+// Cut a ring back to the audio before the mark in its record (rec), unrolling it if it had
+// wrapped or may have wrapped since, and make its header describe that. The header and the
+// record end up as wav_rec_finalize() would leave them.
+static void _ring_repair(const uint8_t *rec)
+{
+  DWORD clustBytes = gFile.fs->csize * 512UL;
+  DWORD mark = *(uint32_t *)(rec+4);
+  DWORD drop = *(uint32_t *)(rec+8);
+  DWORD end = mark;
+  UINT bytesWritten;
+  uint8_t zeros[WAV_RING_RECORD_SIZE];
+
+  gRingEnd = f_size(&gFile);
+  if ((mark < gDataStart) || (mark >= gRingEnd) || (gDataStart % clustBytes) || (gRingEnd % clustBytes)) return;
+  if (drop > gRingEnd - gDataStart) drop = gRingEnd - gDataStart;
+
+  if (rec[12] || (mark + drop > gRingEnd)) {
+    // The 'drop' bytes after the mark go to the end of the chain, and are then cut off
+    gRawOffset = mark + drop;
+    if (gRawOffset > gRingEnd) gRawOffset -= gRingEnd - gDataStart;
+    if (! clmap_build(&gFile) || ! _ring_unroll()) return;
+    end = gRingEnd - drop;
+  }
+
+  if ((f_lseek(&gFile, end) != FR_OK) || (f_truncate(&gFile) != FR_OK)) return;
+
+  // RIFF size, data chunk size, and a cleared record
+  memset(zeros, 0, sizeof(zeros));
+  if (_repair_write(4, end - 8) && _repair_write(gDataStart-4, end - gDataStart)
+      && (f_lseek(&gFile, gRingRecord) == FR_OK)) {
+    (void) f_write(&gFile, zeros, sizeof(zeros), &bytesWritten);
+  }
+}
+
+// Fix up a recording that was never finalized, e.g., because of a power failure. Its header
+// is trusted as of the last checkpoint and the file is cut back to the audio it describes,
+// dropping the unused part of a presized file. A ring is unrolled as of its last checkpoint.
+// Called when the card is mounted.
+void wav_repair(void)
+{
+  char fname[13];
+  uint8_t buf[8];
+  uint8_t rec[WAV_RING_RECORD_SIZE];
+  UINT bytesRead;
+  DWORD ofs = 12; // First chunk after "RIFF" size "WAVE"
+
+  eeprom_read_block(fname, gRepairName, sizeof(fname));
+  if ((fname[0] == 0) || (fname[0] == (char)0xFF)) return;
+
+  if (f_open(&gFile, fname, FA_READ | FA_WRITE | FA_OPEN_EXISTING) == FR_OK) {
+    rec[0] = 0;
+
+    // Walk the chunks to the data chunk, then cut the file back to the end of it
+    while ((f_lseek(&gFile, ofs) == FR_OK)
+           && (f_read(&gFile, buf, 8, &bytesRead) == FR_OK) && (bytesRead == 8)) {
+      // Raw recordings have a JUNK chunk, which starts with the ring record for a ring
+      if (! memcmp_P(buf, PSTR("JUNK"), 4) && (*(uint32_t *)(buf+4) >= WAV_RING_RECORD_SIZE)) {
+        gRingRecord = ofs + 8;
+        if ((f_read(&gFile, rec, WAV_RING_RECORD_SIZE, &bytesRead) != FR_OK) || (bytesRead != WAV_RING_RECORD_SIZE)) break;
+      }
+
+      gDataStart = ofs + 8;
+      ofs += 8 + *(uint32_t *)(buf+4);
+      if (! memcmp_P(buf, PSTR("data"), 4)) {
+        if (! memcmp_P(rec, PSTR("RING"), 4)) {
+          _ring_repair(rec);
+        } else if ((ofs < f_size(&gFile)) && (f_lseek(&gFile, ofs) == FR_OK)) {
+          (void) f_truncate(&gFile);
+        }
+        break;
+      }
+    }
+    (void) f_close(&gFile);
+  }
+
+  _set_repair_name(0);
+}
+
+uint8_t wav_rec_finalize(void)
+{
+  FRESULT fresult;
+  DWORD dataBytes;
+  uint8_t ok;
+  uint8_t degraded = (gDegradeState >= DEGRADE_FINALIZE);
+#if WITH_CUE==1
+  // Cue marker positions count from the start of the recording, i.e., of its first file, and
+  // a wrapped ring has lost its start
+  FIL *cueFile = (((gRotateState == ROTATE_OFF) || (gRotateNumber == 1)) && (gDegradeState <= DEGRADE_ARMED)
+                  && ! (gRawMode && gRingWrapped)) ? &gFile : 0;
+#endif
 
   (void) fail_major(FAIL_WAV_FINALIZE);
 
-  // Raw number of bytes written after all header info
-  subChunk2Size = f_tell(&gFile) - 44;
+  _rotate_end();
+  _degrade_end();
+  gDegradeState = DEGRADE_OFF;
+
+  if (gRawMode) {
+    if (gRingWrapped && ! _ring_unroll()) return 0;
+
+    // Catch FatFs up on what was written behind its back
+    fresult = f_lseek(&gFile, gRawOffset);
+    if (fresult != FR_OK) return fail_minor(FAIL_WAV_SEEK);
+    gFile.flag |= FA__WRITTEN;
+  }
 
   // Truncate file here in case it was presized
   fresult = f_truncate(&gFile);
   if (fresult != FR_OK) return fail_minor(FAIL_WAV_TRUNCATE);
+  dataBytes = _data_bytes();
 
-  fresult = f_lseek(&gFile, 0);
-  if (fresult != FR_OK) return fail_minor(FAIL_WAV_SEEK);
-
-  memcpy_P(buf, PSTR("RIFF    WAVEfmt \x10\x00\x00\x00\x01\x00"), 22);
-  *(uint32_t *)(buf+4) = subChunk2Size + 36;
-
-  fresult = f_write(&gFile, buf, 22, &bytesWritten);
-  if ((fresult != FR_OK) || (bytesWritten != 22)) return fail_minor(FAIL_WAV_NO_HEADER);
-
-  // Now write out WAVINFO header
-  fresult = f_write(&gFile, &gWAVInfo, 14, &bytesWritten);
-  if ((fresult != FR_OK) || (bytesWritten != 14)) return fail_minor(FAIL_WAV_NO_HEADER);
+#if WITH_CUE==1
+  // Cue markers go in chunks after the data chunk, which is always of even length so needs no
+  // pad byte. Should that fail, the file is cut back to the data chunk and the markers are lost.
+  if (! cue_finish(cueFile, &gTrailerBytes)) {
+    (void) f_lseek(&gFile, gDataStart + dataBytes);
+    (void) f_truncate(&gFile);
+    gTrailerBytes = 0;
+  }
+#endif
 
-  // Finally write out last 8 bytes of header, "data" plus subchunk2 size
-  memcpy_P(buf, PSTR("data    "), 8);
-  *(uint32_t *)(buf+4) = subChunk2Size;
+  // The file isn't a ring anymore, so the header clears the ring record
+  gRingMode = 0;
+  ok = _write_header(&gFile, dataBytes);
+  gTrailerBytes = 0;
+  if (! ok) return 0;
 
-  fresult = f_write(&gFile, buf, 8, &bytesWritten);
-  if ((fresult != FR_OK) || (bytesWritten != 8)) return fail_minor(FAIL_WAV_NO_HEADER);
+  // The recording is complete, nothing for wav_repair() to do
+  _set_repair_name(0);
 
+  // Leave the host a way to tell that the recording carried on in a second file
+  if (degraded) {
+    (void) fail(FAIL_REC, FAIL_REC_DEGRADED);
+    return 1;
+  }
   return fail_nofail();
 }
 
+// Create a file of the given size so that recording doesn't have to allocate clusters as it goes.
+// If there is a contiguous run of free clusters big enough, the file is placed there so that
+// raw recording can stream it with the fewest possible writes.
 uint8_t presize_wav_file(const char *fname, uint16_t megabytes)
 {
   FRESULT fresult;
+  DWORD bytes = (DWORD)megabytes * 1048576UL/*1024UL * 1024UL*/;
+  DWORD clust;
 
   (void) fail_major(FAIL_WAV_PRESIZE);
 
   fresult = f_open(&gFile, fname, FA_WRITE | FA_CREATE_ALWAYS);
   if (fresult != FR_OK) return fail_minor(FAIL_WAV_NO_FILE);
 
-  fresult = f_lseek(&gFile, (DWORD)megabytes * 1048576UL/*1024UL * 1024UL*/);
+  // Commit the directory entry so the FAT can be scanned through the FatFs window
+  fresult = f_sync(&gFile);
+  if (fresult != FR_OK) return fail_minor(FAIL_WAV_NO_FILE);
+
+  clust = clmap_find_free(gFile.fs, (bytes + gFile.fs->csize*512UL - 1) / (gFile.fs->csize*512UL));
+  if (clust) {
+    gFile.fs->last_clust = clust-1; // FatFs allocates starting just after its last allocation
+  }
+
+  fresult = f_lseek(&gFile, bytes);
   if (fresult != FR_OK) return fail_minor(FAIL_WAV_SEEK);
 
   (void) f_close(&gFile);
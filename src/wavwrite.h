@@ -23,10 +23,35 @@
 #define _WAVWRITE_H_
 
 #include <inttypes.h>
-
-extern uint8_t wav_create(const char *fname, uint8_t stereo, uint16_t Fs);
+#include "ff.h"
+
+typedef enum {
+  WAV_CODEC_PCM,      // 16-bit PCM, as it comes from the ADC
+  WAV_CODEC_ADPCM,    // IMA ADPCM, 4 bits per sample (WITH_ADPCM)
+  WAV_CODEC_PACKED12, // 12 bits per sample, two samples in three bytes (WITH_PACK12)
+} WavCodec_t;
+
+extern uint8_t wav_create(const char *fname, uint8_t channels, uint16_t Fs, WavCodec_t codec);
+extern void    wav_set_raw(uint8_t enable);
+extern uint8_t wav_raw_requested(void);
+extern void    wav_set_preerase(uint8_t enable);
+extern void    wav_set_ring(uint8_t enable);
+extern void    wav_get_write_stats(uint8_t *erased, uint32_t *count, uint32_t *ticks, uint16_t *max);
+extern void    wav_get_erase_stats(uint32_t *count, uint32_t *ticks);
+extern uint8_t wav_write(const uint8_t *buf, UINT len);
 extern uint8_t presize_wav_file(const char *fname, uint16_t megabytes);
 extern uint8_t wav_rec_finalize(void);
+extern void    wav_set_checkpoint(uint16_t seconds);
+extern uint8_t wav_checkpoint_due(void);
+extern uint8_t wav_checkpoint(void);
+extern void    wav_repair(void);
+extern void    wav_set_rotate_seconds(uint32_t seconds);
+extern void    wav_set_rotate_megabytes(uint16_t megabytes);
+extern uint8_t wav_rotate_step(void);
+extern uint8_t wav_degrade_prepare(const char *fname, WavCodec_t codec);
+extern WavCodec_t wav_degrade(void);
+extern void    wav_degrade_step(void);
+extern void    wav_preerase_step(void);
 
 #endif // _WAVWRITE_H_
 // vim: ts=2 sw=2 ai expandtab cindent
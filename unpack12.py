@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+"""Convert a WAV file recorded in the packed 12-bit format (format tag 0x5243) to a
+standard 16-bit PCM WAV file that any audio tool can read:
+
+   python unpack12.py REC.WAV out.wav
+
+Each pair of samples is stored in 3 bytes as the 24-bit little-endian value
+(b>>4)<<12 | (a>>4). Chunks other than "fmt " and "data" are copied verbatim.
+
+  Rugged Audio Shield Firmware for ATxmega
+
+  Copyright (c) 2012 Rugged Circuits LLC.  All rights reserved.
+  http://ruggedcircuits.com
+
+  This file is part of the Rugged Circuits Rugged Audio Shield firmware distribution.
+
+  This is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3 of the License, or (at your option) any later
+  version.
+
+  This software is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  A copy of the GNU General Public License can be viewed at
+  <http://www.gnu.org/licenses>
+
+"""
+
+import struct
+import sys
+
+WAVE_FORMAT_PACKED12 = 0x5243
+
+def unpack(data):
+  out = bytearray()
+  data = bytearray(data)
+  for i in range(0, len(data) - len(data) % 3, 3):
+    p0, p1, p2 = data[i], data[i+1], data[i+2]
+    out.extend((((p0 << 4) & 0xF0), (((p1 << 4) | (p0 >> 4)) & 0xFF), (p1 & 0xF0), p2))
+  return bytes(out)
+
+if len(sys.argv) != 3:
+  print("Usage: %s packed.wav out.wav" % sys.argv[0])
+  sys.exit(1)
+
+try:
+  infid = open(sys.argv[1], "rb")
+  riff = infid.read()
+  infid.close()
+except:
+  print("Cannot open input file")
+  sys.exit(2)
+
+if riff[0:4] != b"RIFF" or riff[8:12] != b"WAVE":
+  print("Not a WAV file")
+  sys.exit(3)
+
+chunks = []
+fmt = None
+pos = 12
+while pos + 8 <= len(riff):
+  ckid = riff[pos:pos+4]
+  cksize = struct.unpack("<I", riff[pos+4:pos+8])[0]
+  body = riff[pos+8:pos+8+cksize]
+  pos += 8 + cksize + (cksize & 1)
+
+  if ckid == b"fmt ":
+    fmt = struct.unpack("<HHIIHH", body[:16])
+    if fmt[0] != WAVE_FORMAT_PACKED12:
+      print("Not a packed 12-bit file (format tag 0x%04X)" % fmt[0])
+      sys.exit(4)
+    channels, fs = fmt[1], fmt[2]
+    body = struct.pack("<HHIIHH", 1, channels, fs, fs*channels*2, channels*2, 16)
+  elif ckid == b"data":
+    if fmt is None:
+      print("No fmt chunk before data chunk")
+      sys.exit(5)
+    body = unpack(body)
+  chunks.append(ckid + struct.pack("<I", len(body)) + body + (b"\0" * (len(body) & 1)))
+
+out = b"".join(chunks)
+try:
+  outfid = open(sys.argv[2], "wb")
+  outfid.write(b"RIFF" + struct.pack("<I", len(out) + 4) + b"WAVE" + out)
+  outfid.close()
+except:
+  print("Cannot write output file")
+  sys.exit(6)
+
+sys.exit(0)